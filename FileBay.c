@@ -1,26 +1,57 @@
 #define HASHMAP_IMPLEMENTATION
+#define MINHEAP_IMPLEMENTATION
+#define MPSCQ_IMPLEMENTATION
+#define LRU_IMPLEMENTATION
+#define METRICS_IMPLEMENTATION
+#define TRIE_IMPLEMENTATION
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "hashmap.h"
+#include "minheap.h"
+#include "mpscq.h"
+#include "lru.h"
+#include "metrics.h"
+#include "trie.h"
 #include "mongoose.h"
 
 #define CONFIG_FILE "CONFIG"
-#define CONFIG_NUM_EXPECT 6
+#define CONFIG_NUM_EXPECT 16
 
 #define ASCII_LOGO_PATH "assets/ascii_logo"
 
-#define SERIALIZE_VER 4 // version parameter, use to check serialzation version conflict
+#define SERIALIZE_VER 7 // version parameter, use to check serialzation version conflict
+
+#define SNAPSHOT_MAGIC 0x53594246              // "FBYS", leads the snapshot header
+#define JOURNAL_MAGIC 0x4a594246               // "FBYJ", leads the journal header
+#define JOURNAL_CLEAN 1                        // journal header flag, set by a clean shutdown
+#define SESSION_MAGIC 0x50594246               // "FBYP", leads an upload session checkpoint
+#define JOURNAL_COMPACT_BYTE (4 * 1024 * 1024) // fold the journal into a snapshot past this size
+#define JOURNAL_RECORD_MAX 4096                // sanity bound on one journal record
+#define JOURNAL_BUF_ALIGN 4096
 
 #define FILENODEPERMALLOC 5
 
 #define HASHMAP_SIZE 256
 
+#define SESSION_SWEEP_MS 5000 // how often upload sessions are checkpointed and checked for idleness
+#define SESSION_SID_RETRY 16 // attempts to find a free sid slot
+#define HASH_READ_BYTE 65536 // buffer for hashing chunks that arrived ahead of the prefix
+#define CACHE_FILE_MAX_BYTE (1024 * 1024) // larger downloads always go to disk
+#define RATE_BURST_MS 100 // a rate limit lets this many milliseconds worth of bytes pass at once
+#define LAG_PROBE_MS 100 // period of the timer that measures event loop lag
+
 #ifdef DEBUG
 #define debug(msg, ...)                             \
     do                                              \
@@ -36,16 +67,19 @@
 
 #define USE_ROUTER(router_name, ...) router_##router_name(c, ev, ev_data, hm, ##__VA_ARGS__)
 
-static int service_should_stop = 0;
+typedef void (*RouterFn)(struct mg_connection *c, int ev, void *ev_data, struct mg_http_message *hm);
+
+static volatile sig_atomic_t service_should_stop = 0;
 static pthread_t tid;
 static struct MHD_Daemon *d;
 static int nr_of_uploading_clients = 0;
 
-static struct mg_mgr mgr;
-
 // config parameter
 static int file_max_byte, file_expire, worker_period_minute, file_max_count;
-static char storage_dir[32], dump_dist[128];
+static int session_max_count, session_expire, worker_count, cache_max_byte;
+static int send_rate, conn_send_rate, recv_rate, conn_recv_rate;
+static int io_uring;
+static char storage_dir[32], dump_dist[128], journal_dist[128];
 
 static unsigned char serialization_ver = SERIALIZE_VER;
 
@@ -54,29 +88,221 @@ static const char *cached_exts[] = {".png", ".jpg", ".jpeg", ".webp", ".gif", ".
 
 typedef struct FileNode
 {
-    int id;
+    int id; // storage id, shared by every node with the same content
     int is_del;
     char *file_name;
     size_t file_size;
     time_t expire_time;
     unsigned int pwd;
+    unsigned char digest[32]; // sha256 of the content
 } FileNode;
 
-static struct
+// storage file holding one content, referenced by the nodes that uploaded it
+typedef struct Blob
+{
+    unsigned char digest[32];
+    int id;   // storage id of the file
+    int refs; // live nodes pointing at it
+} Blob;
+
+// snapshot layout, fixed width so the dump can be used straight from mmap
+typedef struct SnapshotHeader
+{
+    uint32_t magic;
+    uint32_t version;     // SERIALIZE_VER
+    uint64_t journal_gen; // journal generation the snapshot supersedes
+    uint32_t count;       // records following the header
+    int32_t next_id;      // FileNode_next_id at the time of the dump
+    uint64_t names_len;   // bytes of the name section following the records
+    uint32_t crc;         // crc32 over records and names
+    uint32_t reserved;
+} SnapshotHeader;
+
+typedef struct SnapshotRecord
+{
+    int32_t id;
+    uint32_t pwd;
+    uint64_t file_size;
+    int64_t expire_time;
+    uint64_t name_off; // offset of the NUL terminated name in the name section
+    uint8_t digest[32];
+} SnapshotRecord;
+
+// bytes [start, end) of an upload that have been written
+typedef struct UploadRange
+{
+    size_t start, end;
+} UploadRange;
+
+// upload session checkpoint, storage_dir/<id>.part, followed by range_num ranges and a crc32
+typedef struct SessionCheckpoint
 {
-    int sid;
+    uint32_t magic;
+    int32_t sid;
+    int32_t id; // storage id of the staging file
+    uint32_t pwd;
+    int64_t expire_time;
+    uint32_t range_num;
+    uint32_t reserved;
+} SessionCheckpoint;
+
+typedef struct UploadSession
+{
+    int sid; // -1 if the slot is free
     FileNode file_node;
-} sid_buf = {
-    .sid = -1,
-};
+    time_t last_active;
+    int fd;           // staging file, open for the whole session
+    size_t committed;    // bytes written from offset 0 without a gap, all hashed
+    mg_sha256_ctx sha;   // digest of the committed bytes
+    UploadRange *ranges; // received ranges, sorted and disjoint, chunks may come in any order
+    int range_num, range_max;
+    UploadRange *claims; // gaps being written without session_lock, disjoint from ranges
+    int claim_num, claim_max;
+    int is_dirty;   // ranges grew since the last checkpoint
+    int is_hashing; // a thread extends the digest without session_lock
+} UploadSession;
+
+// a session's checkpoint copied out under session_lock, made durable without it
+typedef struct PendingCheckpoint
+{
+    SessionCheckpoint cp;
+    UploadRange *ranges;
+    int fd; // dup of the staging file, the session may close its own meanwhile
+} PendingCheckpoint;
+
+// a chunk trimmed to the gaps it fills, see claim_Session
+typedef struct SessionWrite
+{
+    int sid, id; // session it was claimed on, looked up again afterwards
+    int fd;      // dup of the staging file, the session may close its own meanwhile
+    size_t offset, len;
+    const char *buf;
+    UploadRange *pieces; // sorted
+    int piece_num;
+} SessionWrite;
+
+// per-connection state of an upload body being streamed to disk
+typedef struct UploadStream
+{
+    int sid;     // -1 once the body is being discarded
+    int replied; // a reply has been queued already
+    size_t offset;
+    size_t expected;
+    size_t received;
+    uint64_t start_us;      // headers arrived, the upload latency counts from here
+    mg_event_handler_t pfn; // HTTP protocol handler to restore afterwards
+} UploadStream;
 
 static FileNode *FileNodeList;
 static int FileNode_off = 0;
 static int FileNode_max = 0;
 static int FileNode_num = 0; // it may not equal to FileNode_off due to the dirty bit (is_del) design
+static int FileNode_next_id = 0; // storage id handed to the next upload
 static Hashmap *FileNode_hashmap;
+static Hashmap *Blob_hashmap; // digest prefix -> Blob, guarded like FileNode_hashmap
+
+// names loaded from the snapshot point into its mapping, which lives until exit
+static char *snapshot_map = NULL;
+static size_t snapshot_len = 0;
+
+// FileNodeList and FileNode_hashmap are only changed on the event loops, under the write lock
+static pthread_rwlock_t FileNode_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// message between the event loop and the cleaner, see cleaner_worker
+typedef struct ExpiryMsg
+{
+    MpscNode link;
+    time_t expire_time;
+    int off; // FileNodeList offset
+    int id;  // storage id, for unlink requests
+} ExpiryMsg;
+
+// expiry index: FileNodeList offsets ordered by expire_time, owned by the cleaner
+static MinHeap *expiry_heap;
+static MpscQueue schedule_queue; // loop -> cleaner, new deadlines
+static MpscQueue expired_queue;  // cleaner -> first worker, offsets past their deadline
+static MpscQueue unlink_queue;   // loop -> cleaner, storage files to remove
+static sem_t cleaner_sem;        // posted with every message for the cleaner
+
+static UploadSession *SessionList; // session_max_count slots
+static int Session_num = 0;
+static Hashmap *Session_hashmap;
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER; // guards the session table
+
+// contents of small, recently downloaded blobs, keyed by storage id
+static LruCache *download_cache; // NULL if cache_max_byte is 0
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifndef FILEBAY_NO_MAIN
+// server wide byte rates, shared by the connections of every worker
+static struct mg_rate send_limit, recv_limit;
+#endif
+
+// routers with a latency histogram of their own, see ROUTER(metrics)
+enum
+{
+    ROUTE_APPLY,
+    ROUTE_UPLOAD,
+    ROUTE_FINALIZER,
+    ROUTE_DOWNLOAD,
+    ROUTE_STATIC,
+    ROUTE_OTHER,
+    ROUTE_NUM,
+};
+
+static const char *route_names[ROUTE_NUM] = {"apply", "upload", "finalizer", "download", "static", "other"};
+
+// counters of one worker, only its own thread writes them
+typedef struct Metrics
+{
+    Histogram request[ROUTE_NUM];
+    Histogram loop_lag; // how late the LAG_PROBE_MS timer fires
+    Counter byte_in, byte_out;
+    Counter accepted, closed;
+} Metrics;
+
+// one event loop per thread, all listening on the same port through SO_REUSEPORT
+typedef struct Worker
+{
+    struct mg_mgr mgr;
+    Hashmap *subscribers;      // websocket connection id -> connection, see broadcast_status
+    unsigned long listener_id; // mg_wakeup target
+    int busy_sent;             // state the subscribers were told last
+    uint64_t lag_due;          // time the lag probe should fire next
+    Metrics metrics;
+    pthread_t tid;
+} Worker;
+
+static Worker *WorkerList;
+
+static Trie *route_trie; // uri -> routes index, see init_routes
+
+// 1 while no new upload can start, pushed to /api/status subscribers when it flips
+static atomic_int service_busy;
 
-static Hashmap *ws_timer_hashmap;
+static Histogram cleaner_run;             // written by the cleaner thread only
+static _Atomic int64_t storage_byte = 0;  // size of the stored blobs, changed under the FileNode write lock
+
+// metadata journal, see journal_append
+enum
+{
+    JOURNAL_ADD = 1, // node finalized
+    JOURNAL_EXPIRE,  // node expired, its file may still be on disk
+    JOURNAL_DELETE,  // file of an expired node unlinked
+};
+
+static int journal_fd = -1;
+static uint64_t journal_gen = 0; // snapshot generation the journal applies on top of
+static size_t journal_size = 0;  // bytes in the journal file
+static struct mg_iobuf journal_buf = {NULL, 0, 0, JOURNAL_BUF_ALIGN}; // records waiting for the next group commit
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;    // guards journal_buf
+static pthread_mutex_t journal_io_lock = PTHREAD_MUTEX_INITIALIZER; // held while the journal file is written
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+#ifndef FILEBAY_NO_MAIN
+static pthread_t journal_tid;
+#endif
+
+void journal_append(unsigned char type, const FileNode *node);
 
 void print_logo()
 {
@@ -132,6 +358,47 @@ unsigned int generate_rand_6digit()
     return 100000 + rand() % 900000;
 }
 
+/*
+ * lock FileNodeList for reading on the request path
+ * with a single worker every write happens on the reading thread itself, so no lock is taken
+ *
+ */
+static void FileNode_read_lock()
+{
+    if (worker_count > 1)
+        pthread_rwlock_rdlock(&FileNode_lock);
+}
+
+static void FileNode_read_unlock()
+{
+    if (worker_count > 1)
+        pthread_rwlock_unlock(&FileNode_lock);
+}
+
+FileNode *get_FileNode(unsigned int pwd)
+{
+    // only live nodes are indexed, the cleaner drops expired keys
+    // caller holds FileNode_lock
+    return (FileNode *)hashmap_search(FileNode_hashmap, pwd);
+}
+
+/*
+ * pick a pickup code that no live file is using
+ *
+ */
+unsigned int generate_unique_pwd()
+{
+    unsigned int pwd;
+
+    FileNode_read_lock();
+    do
+        pwd = generate_rand_6digit();
+    while (get_FileNode(pwd));
+    FileNode_read_unlock();
+
+    return pwd;
+}
+
 FileNode create_FileNode(const char *file_name, size_t file_size)
 {
     time_t cur_time;
@@ -140,10 +407,10 @@ FileNode create_FileNode(const char *file_name, size_t file_size)
     FileNode node = {
         .file_name = strdup(file_name),
         .file_size = file_size,
-        .id = FileNode_off,
+        .id = FileNode_next_id++,
         .is_del = 0,
         .expire_time = cur_time + file_expire * 60,
-        .pwd = generate_rand_6digit(),
+        .pwd = generate_unique_pwd(),
     };
 
     return node;
@@ -155,16 +422,16 @@ FileNode create_standby_FileNode()
     time(&cur_time);
 
     FileNode node = {
-        .id = FileNode_off,
+        .id = FileNode_next_id++,
         .is_del = 0,
         .expire_time = cur_time + file_expire * 60,
-        .pwd = generate_rand_6digit(),
+        .pwd = generate_unique_pwd(),
     };
 
     return node;
 }
 
-int add_FileNode(FileNode cur)
+static int append_FileNode(FileNode cur)
 {
     // Allocate memory if not already done
     if (!FileNodeList)
@@ -179,58 +446,174 @@ int add_FileNode(FileNode cur)
         FileNode_max = FILENODEPERMALLOC;
     }
 
-    // Check if there is space for a new node
+    // Check if there is space for a new node, grow geometrically
     if (FileNode_off >= FileNode_max)
     {
-        FileNode *temp = realloc(FileNodeList, sizeof(FileNode) * (FileNode_max + FILENODEPERMALLOC));
+        FileNode *temp = realloc(FileNodeList, sizeof(FileNode) * FileNode_max * 2);
         if (!temp)
         {
             perror("Failed to reallocate memory for FileNodeList");
             return 1;
         }
-        FileNodeList = temp;
-        FileNode_max += FILENODEPERMALLOC;
+        FileNode_max *= 2;
+
+        // the hashmap points into the list, repoint it if the list moved
+        if (temp != FileNodeList)
+        {
+            FileNodeList = temp;
+            for (int i = 0; i < FileNode_off; ++i)
+            {
+                if (!FileNodeList[i].is_del)
+                    hashmap_put(FileNode_hashmap, FileNodeList[i].pwd, (void *)(FileNodeList + i));
+            }
+        }
+    }
+
+    if (hashmap_insert(FileNode_hashmap, cur.pwd, (void *)(FileNodeList + FileNode_off)))
+    {
+        fprintf(stderr, "Failed to index file %s, pickup code %u is taken\n", cur.file_name, cur.pwd);
+        return 1;
     }
 
     // Copy the new node to the heap
     memcpy(FileNodeList + FileNode_off, &cur, sizeof(FileNode));
-    hashmap_insert(FileNode_hashmap, cur.pwd, (void *)(FileNodeList + FileNode_off));
     debug("insert key: %d value: %p", cur.pwd, FileNodeList + FileNode_off);
     FileNode_num++;
     FileNode_off++;
+    if (cur.id >= FileNode_next_id)
+        FileNode_next_id = cur.id + 1;
     return 0;
 }
 
-FileNode *get_FileNode(unsigned int pwd)
+/*
+ * content addressed storage, callers hold FileNode_lock for writing
+ * blobs are keyed by the first 8 bytes of the digest, a node whose digest
+ * only shares the prefix with a stored blob keeps a file of its own
+ *
+ */
+static uint64_t blob_key(const unsigned char *digest)
+{
+    uint64_t key;
+    memcpy(&key, digest, sizeof(key));
+    return key;
+}
+
+Blob *get_Blob(const unsigned char *digest)
 {
-    // attempt to get from hashmap, use brute force if collide
-    FileNode *exp;
+    Blob *blob = hashmap_search(Blob_hashmap, blob_key(digest));
+    return blob && memcmp(blob->digest, digest, sizeof(blob->digest)) == 0 ? blob : NULL;
+}
 
-    exp = (FileNode *)hashmap_search(FileNode_hashmap, pwd);
-    if (exp && exp->pwd == pwd)
+// count the node as a reference to its storage file
+static void ref_Blob(const FileNode *node)
+{
+    Blob *blob = get_Blob(node->digest);
+    if (blob && blob->id == node->id)
     {
-        debug("hit the hash map!");
-        return exp;
+        blob->refs++;
+        return;
     }
-    else
+
+    // a storage file of its own
+    atomic_fetch_add_explicit(&storage_byte, node->file_size, memory_order_relaxed);
+    if (blob || !(blob = malloc(sizeof(Blob))))
+        return;
+
+    memcpy(blob->digest, node->digest, sizeof(blob->digest));
+    blob->id = node->id;
+    blob->refs = 1;
+    if (hashmap_insert(Blob_hashmap, blob_key(node->digest), blob))
+        free(blob); // prefix collision, the node keeps its file to itself
+}
+
+/*
+ * drop the node's reference
+ * Returns: 1 if its storage file is no longer used
+ *
+ */
+static int unref_Blob(const FileNode *node)
+{
+    Blob *blob = get_Blob(node->digest);
+    if (blob && blob->id == node->id && --blob->refs > 0)
+        return 0;
+
+    atomic_fetch_sub_explicit(&storage_byte, node->file_size, memory_order_relaxed);
+    if (!blob || blob->id != node->id)
+        return 1;
+
+    hashmap_delete(Blob_hashmap, blob_key(node->digest));
+    free(blob);
+    return 1;
+}
+
+void freeBlobs()
+{
+    for (size_t i = 0; i < Blob_hashmap->size; ++i)
     {
-        return NULL;
+        if (Blob_hashmap->entries[i].dist)
+            free(Blob_hashmap->entries[i].value);
     }
+    freeHashmap(Blob_hashmap);
+}
 
-    if (FileNodeList)
+/*
+ * hand a message to the cleaner thread
+ *
+ */
+static void post_cleaner(MpscQueue *queue, time_t expire_time, int off, int id)
+{
+    ExpiryMsg *msg = malloc(sizeof(ExpiryMsg));
+    if (!msg)
     {
-        for (int i = 0; i < FileNode_off; ++i)
-        {
-            if (FileNodeList[i].pwd == pwd)
-            {
-                if (FileNodeList[i].is_del)
-                    return NULL;
+        perror("Failed to allocate memory for ExpiryMsg");
+        return;
+    }
 
-                return (FileNode *)&FileNodeList[i];
-            }
-        }
+    msg->expire_time = expire_time;
+    msg->off = off;
+    msg->id = id;
+    mpsc_push(queue, &msg->link);
+    sem_post(&cleaner_sem);
+}
+
+/*
+ * index a finalized upload, sharing the storage file of a blob with the same digest
+ *
+ * dedup only saves disk space: the digest is known once the last chunk is in,
+ * so a duplicate is still received, written to staging and hashed in full before
+ * its copy is dropped here. Taking a digest from the client up front would skip
+ * that, but would also hand out a pickup code to anyone who knows a file's hash
+ *
+ */
+int add_FileNode(FileNode cur)
+{
+    int staged_id = cur.id;
+
+    pthread_rwlock_wrlock(&FileNode_lock);
+
+    // same content is stored already, share its file
+    Blob *blob = get_Blob(cur.digest);
+    if (blob)
+        cur.id = blob->id;
+
+    int ret = append_FileNode(cur);
+    if (ret == 0)
+    {
+        ref_Blob(&cur);
+        journal_append(JOURNAL_ADD, &cur);
     }
-    return NULL;
+
+    pthread_rwlock_unlock(&FileNode_lock);
+
+    if (ret == 0)
+    {
+        post_cleaner(&schedule_queue, cur.expire_time, FileNode_off - 1, cur.id);
+
+        // the uploaded copy is redundant
+        if (cur.id != staged_id)
+            post_cleaner(&unlink_queue, 0, -1, staged_id);
+    }
+    return ret;
 }
 
 void freeFileNodeList()
@@ -239,7 +622,9 @@ void freeFileNodeList()
     {
         for (int i = 0; i < FileNode_off; ++i)
         {
-            free(FileNodeList[i].file_name);
+            char *name = FileNodeList[i].file_name;
+            if (name < snapshot_map || name >= snapshot_map + snapshot_len)
+                free(name);
         }
 
         free(FileNodeList);
@@ -250,448 +635,2535 @@ void freeFileNodeList()
     }
 }
 
-int serialize_FileNodeList()
+/*
+ * helper functions for managing upload sessions, callers hold session_lock
+ *
+ */
+int init_SessionList()
 {
-    FILE *file = fopen(dump_dist, "wb");
-    if (!file)
+    SessionList = malloc(sizeof(UploadSession) * session_max_count);
+    if (!SessionList)
     {
-        perror("Failed to open file for writing");
-        return -1;
+        perror("Failed to allocate memory for SessionList");
+        return 1;
     }
 
-    // dump the file node list version
-    fwrite(&serialization_ver, sizeof(unsigned char), 1, file);
-
-    for (int i = 0; i < FileNode_off; i++)
-    {
-
-        debug("serialize filename: %s\n", FileNodeList[i].file_name);
-        if (FileNodeList[i].is_del)
-        {
-            // ignore if the FileNode marked as delete
-            continue;
-        }
-
-        // Serialize id, file_size, expire_time as before
-        fwrite(&FileNodeList[i].id, sizeof(int), 1, file);
-        fwrite(&FileNodeList[i].file_size, sizeof(size_t), 1, file);
-        fwrite(&FileNodeList[i].expire_time, sizeof(time_t), 1, file);
-        fwrite(&FileNodeList[i].pwd, sizeof(unsigned int), 1, file);
-
-        // Serialize file_name
-        size_t name_length = strlen(FileNodeList[i].file_name) + 1; // +1 for null terminator
-        fwrite(&name_length, sizeof(size_t), 1, file);
-        fwrite(FileNodeList[i].file_name, sizeof(char), name_length, file);
-    }
+    for (int i = 0; i < session_max_count; ++i)
+        SessionList[i].sid = -1;
 
-    fclose(file);
-    printf("file node list serialized to: %s\n", dump_dist);
-    return 0; // Success
+    Session_hashmap = createHashmap(HASHMAP_SIZE);
+    return 0;
 }
 
 /*
- * deserialize the local dump, and initialize the FileNodeList
+ * recompute the busy state after a session or file node count changed, caller holds session_lock
+ * the workers are only woken up when the state flips, they push it to their own subscribers
  *
  */
-int deserialize_FileNodeList()
+void update_service_status()
 {
-    FILE *file = fopen(dump_dist, "rb");
-    if (!file)
-        return 0;
+    FileNode_read_lock();
+    int is_busy = Session_num >= session_max_count || FileNode_num + Session_num >= file_max_count;
+    FileNode_read_unlock();
 
-    size_t name_length;
-    int ret;
+    if (atomic_exchange(&service_busy, is_busy) == is_busy || !WorkerList)
+        return;
 
-    // check for version mismatched
-    unsigned char dist_serialization_ver;
-    ret = fread(&dist_serialization_ver, sizeof(unsigned char), 1, file);
-    if (ret && dist_serialization_ver != serialization_ver)
+    for (int i = 0; i < worker_count; ++i)
+        mg_wakeup(&WorkerList[i].mgr, WorkerList[i].listener_id, "", 0);
+}
+
+UploadSession *create_Session()
+{
+    UploadSession *session = NULL;
+
+    for (int i = 0; i < session_max_count; ++i)
     {
-        fprintf(stderr, "dist dump version %d mismatched with %d\n", dist_serialization_ver, serialization_ver);
-        fclose(file);
-        return 1;
+        if (SessionList[i].sid == -1)
+        {
+            session = SessionList + i;
+            break;
+        }
     }
 
-    FileNode node;
-    int old_file_id;
+    if (!session)
+        return NULL;
 
-    while (fread(&old_file_id, sizeof(int), 1, file) &&
-           fread(&node.file_size, sizeof(size_t), 1, file) == 1 &&
-           fread(&node.expire_time, sizeof(time_t), 1, file) == 1 &&
-           fread(&node.pwd, sizeof(unsigned int), 1, file) == 1)
+    // the sid keys the session hashmap, so retry until it lands on a free slot
+    for (int i = 0; i < SESSION_SID_RETRY; ++i)
     {
-        ret = fread(&name_length, sizeof(size_t), 1, file);
-        node.file_name = malloc(name_length * sizeof(char));
-        ret = fread(node.file_name, sizeof(char), name_length, file);
+        int sid = generate_rand_6digit();
+        if (hashmap_insert(Session_hashmap, sid, (void *)session) == 0)
+        {
+            char filepath[160];
 
-        node.id = FileNode_off;
-        node.is_del = 0;
+            session->file_node = create_standby_FileNode();
+            snprintf(filepath, sizeof(filepath), "%s/%d", storage_dir, session->file_node.id);
 
-        // reassign file id
-        char old_filepath[64], new_filepath[64];
-        sprintf(old_filepath, "%s/%d", storage_dir, old_file_id);
-        sprintf(new_filepath, "%s/_%d", storage_dir, node.id);
+            session->fd = open(filepath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (session->fd < 0)
+            {
+                perror("Failed to open staging file");
+                hashmap_delete(Session_hashmap, sid);
+                return NULL;
+            }
+
+            session->sid = sid;
+            session->committed = 0;
+            mg_sha256_init(&session->sha);
+            session->ranges = session->claims = NULL;
+            session->range_num = session->range_max = 0;
+            session->claim_num = session->claim_max = 0;
+            session->is_dirty = session->is_hashing = 0;
+            session->last_active = time(NULL);
+            Session_num++;
+            update_service_status();
+            return session;
+        }
+    }
 
-        rename(old_filepath, new_filepath);
+    return NULL;
+}
 
-        debug("deserialize filename: %s\n", node.file_name);
-        add_FileNode(node);
+UploadSession *get_Session(int sid)
+{
+    UploadSession *session = hashmap_search(Session_hashmap, sid);
+    if (session && session->sid == sid)
+    {
+        session->last_active = time(NULL);
+        return session;
     }
+    return NULL;
+}
 
-    DIR *dir;
-    struct dirent *entry;
+/*
+ * record [start, end) as received, merging it with every range it touches
+ * Returns: 0 on success, -1 if out of memory
+ *
+ */
+static int add_UploadRange(UploadSession *session, size_t start, size_t end)
+{
+    UploadRange *ranges = session->ranges;
+    int i = 0, j;
 
-    if ((dir = opendir(storage_dir)) == NULL)
+    // ranges [i, j) overlap or adjoin the new one
+    while (i < session->range_num && ranges[i].end < start)
+        i++;
+    for (j = i; j < session->range_num && ranges[j].start <= end; ++j)
     {
-        perror("opendir");
-        return -1;
+        if (ranges[j].start < start)
+            start = ranges[j].start;
+        if (ranges[j].end > end)
+            end = ranges[j].end;
     }
 
-    while ((entry = readdir(dir)) != NULL)
+    if (j == i)
     {
-        if (entry->d_name[0] == '_')
+        if (session->range_num == session->range_max)
         {
-            char old_filepath[325], new_filepath[325];
-
-            sprintf(old_filepath,"%s/%s", storage_dir, entry->d_name);
-            sprintf(new_filepath, "%s/%s", storage_dir, entry->d_name+1);
-
-            rename(old_filepath, new_filepath);
+            int max = session->range_max ? session->range_max * 2 : 4;
+            UploadRange *temp = realloc(ranges, sizeof(UploadRange) * max);
+            if (!temp)
+                return -1;
+            session->ranges = ranges = temp;
+            session->range_max = max;
         }
-    }
 
-    closedir(dir);
+        memmove(ranges + i + 1, ranges + i, sizeof(UploadRange) * (session->range_num - i));
+        session->range_num++;
+    }
+    else
+    {
+        memmove(ranges + i + 1, ranges + j, sizeof(UploadRange) * (session->range_num - j));
+        session->range_num -= j - i - 1;
+    }
 
-    fclose(file);
-    printf("file node list deserialized from: %s with size %d\n", dump_dist, FileNode_off);
-    return 0; // Success
+    ranges[i].start = start;
+    ranges[i].end = end;
+    return 0;
 }
 
 /*
- * Initialize config parameter
- * Returns: 1 if something goes wrong
+ * cut [start, end) out of the sorted pieces, one of them may split in two
+ * Returns: the new number of pieces, room for one more is left by the caller
  *
  */
-int config_initialize()
+static int cut_UploadRange(UploadRange *pieces, int num, size_t start, size_t end)
 {
-    FILE *file = fopen(CONFIG_FILE, "r");
-    if (file == NULL)
+    for (int i = 0; i < num; ++i)
     {
-        perror("Error opening config file");
-        return 1;
-    }
+        UploadRange *p = pieces + i;
 
-    char line[128];
-
-    size_t config_count = 0;
+        if (p->end <= start || p->start >= end)
+            continue;
 
-    while (fgets(line, sizeof(line), file))
-    {
-        if (sscanf(line, "file_max_byte:%d", &file_max_byte) == 1)
-        {
-            config_count++;
-        }
-        else if (sscanf(line, "file_max_count:%d", &file_max_count) == 1)
-        {
-            config_count++;
-        }
-        else if (sscanf(line, "file_expire:%d", &file_expire) == 1)
-        {
-            config_count++;
-        }
-        else if (sscanf(line, "worker_period:%d", &worker_period_minute) == 1)
-        {
-            config_count++;
-        }
-        else if (sscanf(line, "storage_dir:%s", storage_dir) == 1)
-        {
-            config_count++;
-        }
-        else if (sscanf(line, "dump_dist:%s", dump_dist) == 1)
+        if (p->start < start && p->end > end)
         {
-            config_count++;
+            memmove(p + 2, p + 1, sizeof(UploadRange) * (num - i - 1));
+            p[1].start = end;
+            p[1].end = p->end;
+            p->end = start;
+            return num + 1;
         }
+
+        if (p->start < start)
+            p->end = start;
+        else if (p->end > end)
+            p->start = end;
         else
         {
-            fprintf(stderr, "WARNING: invalid config line read: %s\n", line);
+            memmove(p, p + 1, sizeof(UploadRange) * (num - i - 1));
+            num--;
+            i--;
         }
     }
-    fclose(file);
-
-    if (config_count != CONFIG_NUM_EXPECT)
-    {
-        fprintf(stderr, "config load error, expect '%d' but have '%zu'\n", CONFIG_NUM_EXPECT, config_count);
-        return 1;
-    }
 
-    return 0;
+    return num;
 }
 
 /*
- * Worker to clean the expired or unknown files
- * no heap use, kill it as you wish
+ * release the session slot, discard the staged file unless it has been finalized
  *
  */
-
-void *cleaner_worker()
+void free_Session(UploadSession *session, int keep_file)
 {
-    while (!service_should_stop)
+    char filepath[160];
+
+    close(session->fd);
+    free(session->ranges);
+    free(session->claims);
+
+    snprintf(filepath, sizeof(filepath), "%s/%d.part", storage_dir, session->file_node.id);
+    unlink(filepath);
+
+    if (!keep_file)
+    {
+        snprintf(filepath, sizeof(filepath), "%s/%d", storage_dir, session->file_node.id);
+        unlink(filepath);
+    }
+
+    hashmap_delete(Session_hashmap, session->sid);
+    session->sid = -1;
+    Session_num--;
+    update_service_status();
+}
+
+// the session a write or a hash started on, NULL if it was finalized or dropped meanwhile
+static UploadSession *live_Session(int sid, int id)
+{
+    UploadSession *session = hashmap_search(Session_hashmap, sid);
+    return session && session->sid == sid && session->file_node.id == id ? session : NULL;
+}
+
+// end of the gapless prefix received so far
+static size_t prefix_Session(const UploadSession *session)
+{
+    return session->range_num && session->ranges[0].start == 0 ? session->ranges[0].end : 0;
+}
+
+/*
+ * claim the parts of a chunk that land in gaps, nobody else has received or is writing them
+ * bytes received once are never written again: the hashed prefix is in the digest, the rest
+ * may be read back for it any time, and a chunk sent twice with other bytes would make the
+ * finalized file differ from the digest dedup indexes it under
+ * Returns: 0 on success, -1 with errno set otherwise
+ *
+ */
+static int claim_Session(UploadSession *session, SessionWrite *w)
+{
+    int max = session->range_num + session->claim_num + 1;
+
+    w->piece_num = 0;
+    if (!(w->pieces = malloc(sizeof(UploadRange) * max)))
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (w->len > 0)
+    {
+        w->pieces[0] = (UploadRange){w->offset, w->offset + w->len};
+        w->piece_num = 1;
+    }
+
+    for (int i = 0; i < session->range_num && w->piece_num > 0; ++i)
+        w->piece_num = cut_UploadRange(w->pieces, w->piece_num, session->ranges[i].start, session->ranges[i].end);
+    for (int i = 0; i < session->claim_num && w->piece_num > 0; ++i)
+        w->piece_num = cut_UploadRange(w->pieces, w->piece_num, session->claims[i].start, session->claims[i].end);
+
+    if (w->piece_num == 0)
+        return 0;
+
+    if (session->claim_num + w->piece_num > session->claim_max)
+    {
+        int grow = session->claim_num + w->piece_num + 4;
+        UploadRange *temp = realloc(session->claims, sizeof(UploadRange) * grow);
+        if (!temp)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        session->claims = temp;
+        session->claim_max = grow;
+    }
+
+    if ((w->fd = dup(session->fd)) < 0)
+        return -1;
+
+    memcpy(session->claims + session->claim_num, w->pieces, sizeof(UploadRange) * w->piece_num);
+    session->claim_num += w->piece_num;
+    return 0;
+}
+
+// write the claimed pieces, without session_lock
+static int fill_Session(const SessionWrite *w)
+{
+    for (int i = 0; i < w->piece_num; ++i)
+    {
+        size_t done = w->pieces[i].start;
+
+        while (done < w->pieces[i].end)
+        {
+            ssize_t n = pwrite(w->fd, w->buf + (done - w->offset), w->pieces[i].end - done, done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return -1;
+            done += n;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * drop the claims of a written chunk, and record its pieces as received if the write went through
+ * Returns: 0 on success, -1 with errno set otherwise
+ *
+ */
+static int release_Session(UploadSession *session, const SessionWrite *w, int written)
+{
+    for (int i = 0; i < w->piece_num; ++i)
+    {
+        for (int j = 0; j < session->claim_num; ++j)
+        {
+            if (session->claims[j].start == w->pieces[i].start)
+            {
+                session->claims[j] = session->claims[--session->claim_num];
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; written == 0 && i < w->piece_num; ++i)
+    {
+        if (add_UploadRange(session, w->pieces[i].start, w->pieces[i].end) != 0)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        session->is_dirty = 1;
+    }
+
+    return written;
+}
+
+/*
+ * feed [pos, end) of the staging file to the digest, the pieces the chunk
+ * filled are hashed from memory and everything else is read back
+ * Returns: 0 on success, -1 with errno set otherwise
+ *
+ */
+static int hash_range(int fd, mg_sha256_ctx *sha, size_t pos, size_t end, const SessionWrite *w)
+{
+    char chunk[HASH_READ_BYTE];
+    int i = 0;
+
+    while (pos < end)
+    {
+        size_t n = end - pos < sizeof(chunk) ? end - pos : sizeof(chunk);
+
+        while (w && i < w->piece_num && w->pieces[i].end <= pos)
+            i++;
+
+        if (w && i < w->piece_num && w->pieces[i].start <= pos)
+        {
+            n = (w->pieces[i].end < end ? w->pieces[i].end : end) - pos;
+            mg_sha256_update(sha, (const unsigned char *)w->buf + (pos - w->offset), n);
+        }
+        else
+        {
+            if (w && i < w->piece_num && w->pieces[i].start - pos < n)
+                n = w->pieces[i].start - pos;
+
+            ssize_t r = pread(fd, chunk, n, pos);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                return -1;
+
+            n = r;
+            mg_sha256_update(sha, (const unsigned char *)chunk, n);
+        }
+
+        pos += n;
+    }
+
+    return 0;
+}
+
+/*
+ * extend the digest over the gapless prefix, one thread at a time (is_hashing): the bytes
+ * are read without session_lock, received ones are never written again
+ * called with session_lock held and returns with it, the session may be gone by then
+ * Returns: 0 on success, -1 with errno set otherwise
+ *
+ */
+static int hash_Session(UploadSession *session, const SessionWrite *w)
+{
+    int sid = session->sid, id = session->file_node.id;
+
+    // a running hasher takes what this chunk completed on its next round
+    while (session && !session->is_hashing && session->committed < prefix_Session(session))
+    {
+        size_t pos = session->committed, end = prefix_Session(session);
+        mg_sha256_ctx sha = session->sha;
+        int fd = dup(session->fd), ret, err;
+
+        if (fd < 0)
+            return -1;
+
+        session->is_hashing = 1;
+        pthread_mutex_unlock(&session_lock);
+        ret = hash_range(fd, &sha, pos, end, w);
+        err = errno;
+        close(fd);
+        pthread_mutex_lock(&session_lock);
+
+        if (!(session = live_Session(sid, id)))
+            return 0;
+
+        session->is_hashing = 0;
+        if (ret != 0)
+        {
+            errno = err;
+            return -1;
+        }
+        session->sha = sha;
+        session->committed = end;
+    }
+
+    return 0;
+}
+
+/*
+ * write a chunk to the staging file at the given offset, in any order
+ * called with session_lock held, which is released around the writes and the hashing,
+ * so chunks of every session go to disk in parallel. *session is looked up again
+ * afterwards, NULL if the session was finalized or dropped meanwhile
+ * Returns: 0 on success, -1 with errno set otherwise, the session is dropped then
+ *
+ */
+int write_Session(UploadSession **session, size_t offset, const char *buf, size_t len)
+{
+    SessionWrite w = {
+        .sid = (*session)->sid,
+        .id = (*session)->file_node.id,
+        .fd = -1,
+        .offset = offset,
+        .len = len,
+        .buf = buf,
+    };
+    int ret = claim_Session(*session, &w), err;
+
+    if (ret == 0 && w.fd >= 0)
+    {
+        pthread_mutex_unlock(&session_lock);
+        ret = fill_Session(&w);
+        err = errno;
+        close(w.fd);
+        pthread_mutex_lock(&session_lock);
+
+        errno = err;
+        if ((*session = live_Session(w.sid, w.id)))
+            ret = release_Session(*session, &w, ret);
+    }
+
+    if (ret == 0 && (*session = live_Session(w.sid, w.id)))
+        ret = hash_Session(*session, &w);
+
+    *session = live_Session(w.sid, w.id);
+    if (ret != 0 && *session)
+    {
+        err = errno;
+        free_Session(*session, 0);
+        *session = NULL;
+        errno = err;
+    }
+
+    free(w.pieces);
+    return ret;
+}
+
+static void describe_Session(const UploadSession *session, SessionCheckpoint *cp)
+{
+    *cp = (SessionCheckpoint){
+        .magic = SESSION_MAGIC,
+        .sid = session->sid,
+        .id = session->file_node.id,
+        .pwd = session->file_node.pwd,
+        .expire_time = session->file_node.expire_time,
+        .range_num = session->range_num,
+    };
+}
+
+/*
+ * make the received ranges durable: sync the staging file, then write the checkpoint
+ * aside, commit_Checkpoint renames it in. The checkpoint never claims bytes that are
+ * not on disk
+ * Returns: 0 on success, -1 otherwise
+ *
+ */
+static int write_Checkpoint(int fd, const SessionCheckpoint *cp, const UploadRange *ranges)
+{
+    char tmp_path[168];
+    size_t ranges_len = sizeof(UploadRange) * cp->range_num;
+    uint32_t crc = mg_crc32(mg_crc32(0, (char *)cp, sizeof(*cp)), (char *)ranges, ranges_len);
+
+    if (fdatasync(fd) != 0)
+    {
+        perror("Failed to sync staging file");
+        return -1;
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%d.part.tmp", storage_dir, cp->id);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file)
+    {
+        perror("Failed to open session checkpoint");
+        return -1;
+    }
+
+    // a torn checkpoint fails its crc and the session is dropped, nothing worse
+    fwrite(cp, sizeof(*cp), 1, file);
+    fwrite(ranges, 1, ranges_len, file);
+    fwrite(&crc, sizeof(crc), 1, file);
+
+    if (fclose(file) != 0)
+    {
+        perror("Failed to write session checkpoint");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// replace the checkpoint of storage id with the one written aside, or drop that one
+static int commit_Checkpoint(int id, int keep)
+{
+    char filepath[160], tmp_path[168];
+
+    snprintf(filepath, sizeof(filepath), "%s/%d.part", storage_dir, id);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", filepath);
+
+    if (keep && rename(tmp_path, filepath) == 0)
+        return 0;
+
+    if (keep)
+        perror("Failed to replace session checkpoint");
+    unlink(tmp_path);
+    return -1;
+}
+
+// checkpoint in place, for when nothing else touches the session
+int checkpoint_Session(UploadSession *session)
+{
+    SessionCheckpoint cp;
+
+    describe_Session(session, &cp);
+    if (write_Checkpoint(session->fd, &cp, session->ranges) != 0 || commit_Checkpoint(cp.id, 1) != 0)
+        return -1;
+
+    session->is_dirty = 0;
+    return 0;
+}
+
+/*
+ * bring back one checkpointed session, its digest is rebuilt from the staging file
+ * Returns: 0 on success
+ *
+ */
+static int restore_Session(const char *filepath)
+{
+    SessionCheckpoint cp;
+    UploadSession *session = NULL;
+    UploadRange *ranges = NULL;
+    uint32_t crc;
+    char staging_path[160];
+    int ret = -1;
+
+    FILE *file = fopen(filepath, "rb");
+    if (!file)
+        return -1;
+
+    if (fread(&cp, sizeof(cp), 1, file) != 1 || cp.magic != SESSION_MAGIC ||
+        !(ranges = malloc(sizeof(UploadRange) * (cp.range_num ? cp.range_num : 1))) ||
+        fread(ranges, sizeof(UploadRange), cp.range_num, file) != cp.range_num ||
+        fread(&crc, sizeof(crc), 1, file) != 1 ||
+        crc != mg_crc32(mg_crc32(0, (char *)&cp, sizeof(cp)), (char *)ranges, sizeof(UploadRange) * cp.range_num))
+        goto done;
+
+    for (int i = 0; i < session_max_count && !session; ++i)
+    {
+        if (SessionList[i].sid == -1)
+            session = SessionList + i;
+    }
+
+    if (!session || hashmap_insert(Session_hashmap, cp.sid, (void *)session) != 0)
+        goto done;
+
+    snprintf(staging_path, sizeof(staging_path), "%s/%d", storage_dir, cp.id);
+    session->fd = open(staging_path, O_RDWR | O_CLOEXEC);
+    if (session->fd < 0)
+    {
+        hashmap_delete(Session_hashmap, cp.sid);
+        goto done;
+    }
+
+    session->sid = cp.sid;
+    session->file_node = (FileNode){
+        .id = cp.id,
+        .expire_time = cp.expire_time,
+        .pwd = cp.pwd,
+    };
+    session->ranges = ranges;
+    session->range_num = session->range_max = cp.range_num;
+    session->claims = NULL;
+    session->claim_num = session->claim_max = 0;
+    session->is_dirty = session->is_hashing = 0;
+    session->committed = prefix_Session(session);
+    session->last_active = time(NULL); // the client gets a full idle period to come back
+    mg_sha256_init(&session->sha);
+    ranges = NULL;
+
+    if (hash_range(session->fd, &session->sha, 0, session->committed, NULL) != 0)
+    {
+        perror("Failed to read staging file");
+        close(session->fd);
+        free(session->ranges);
+        hashmap_delete(Session_hashmap, cp.sid);
+        session->sid = -1;
+        goto done;
+    }
+
+    if (cp.id >= FileNode_next_id)
+        FileNode_next_id = cp.id + 1;
+    Session_num++;
+    ret = 0;
+
+done:
+    fclose(file);
+    free(ranges);
+    return ret;
+}
+
+/*
+ * restore the upload sessions checkpointed before the last shutdown or crash
+ * checkpoints that can not be restored are removed together with their staging file
+ *
+ */
+int restore_SessionList()
+{
+    DIR *dir;
+    struct dirent *entry;
+    char filepath[325];
+
+    if ((dir = opendir(storage_dir)) == NULL)
+    {
+        perror("opendir");
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char *ext = strchr(entry->d_name, '.');
+        if (!ext || entry->d_name[0] < '0' || entry->d_name[0] > '9')
+            continue;
+
+        sprintf(filepath, "%s/%s", storage_dir, entry->d_name);
+
+        if (strcmp(ext, ".part") == 0 && restore_Session(filepath) == 0)
+        {
+            printf("restore upload session: %s\n", entry->d_name);
+            continue;
+        }
+
+        // leftover checkpoint, or a temp file from an interrupted one
+        if (strcmp(ext, ".part") == 0 || strcmp(ext, ".part.tmp") == 0)
+        {
+            unlink(filepath);
+            if (strcmp(ext, ".part") == 0)
+            {
+                *ext = '\0';
+                sprintf(filepath, "%s/%s", storage_dir, entry->d_name);
+                unlink(filepath);
+            }
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+void freeSessionList()
+{
+    if (SessionList)
+    {
+        // sessions survive a restart, keep the staging files and their checkpoints
+        for (int i = 0; i < session_max_count; ++i)
+        {
+            if (SessionList[i].sid != -1)
+            {
+                checkpoint_Session(SessionList + i);
+                close(SessionList[i].fd);
+                free(SessionList[i].ranges);
+            }
+        }
+
+        free(SessionList);
+        SessionList = NULL;
+    }
+}
+
+/*
+ * drop idle sessions and checkpoint the ones that received data since the last sweep
+ * chunks are acked before they are checkpointed, a crash loses at most one period of
+ * them and a resuming client sends those again
+ *
+ * only the state is copied under session_lock: the staging file is synced and the
+ * checkpoint written without it, then renamed in if the session is still there
+ *
+ */
+void session_sweep_timer_fn(void *data)
+{
+    PendingCheckpoint *pending = malloc(sizeof(PendingCheckpoint) * session_max_count);
+    int pending_num = 0;
+    time_t cur_time = time(NULL);
+
+    pthread_mutex_lock(&session_lock);
+
+    for (int i = 0; i < session_max_count; ++i)
+    {
+        UploadSession *session = SessionList + i;
+        if (session->sid == -1)
+            continue;
+
+        if (session->last_active + session_expire * 60 <= cur_time)
+        {
+            printf("drop idle upload session: %d\n", session->sid);
+            free_Session(session, 0);
+            continue;
+        }
+
+        PendingCheckpoint *p = pending + pending_num;
+        if (!session->is_dirty || !pending || !(p->ranges = malloc(sizeof(UploadRange) * session->range_num)))
+            continue;
+
+        if ((p->fd = dup(session->fd)) < 0)
+        {
+            free(p->ranges);
+            continue;
+        }
+
+        describe_Session(session, &p->cp);
+        memcpy(p->ranges, session->ranges, sizeof(UploadRange) * session->range_num);
+        session->is_dirty = 0;
+        pending_num++;
+    }
+    pthread_mutex_unlock(&session_lock);
+
+    for (int i = 0; i < pending_num; ++i)
+    {
+        PendingCheckpoint *p = pending + i;
+        int ret = write_Checkpoint(p->fd, &p->cp, p->ranges);
+
+        close(p->fd);
+        free(p->ranges);
+
+        // a finalized or dropped session must not get its checkpoint back
+        pthread_mutex_lock(&session_lock);
+        UploadSession *session = live_Session(p->cp.sid, p->cp.id);
+
+        if (session && (ret != 0 || commit_Checkpoint(p->cp.id, 1) != 0))
+            session->is_dirty = 1; // retried on the next sweep
+        else if (!session && ret == 0)
+            commit_Checkpoint(p->cp.id, 0);
+        pthread_mutex_unlock(&session_lock);
+    }
+
+    free(pending);
+    (void)data;
+}
+
+/*
+ * lay the live nodes out as a snapshot image, tagged with the current journal generation
+ * caller holds FileNode_lock, the image is written out after it is released
+ *
+ * layout: SnapshotHeader, one SnapshotRecord per node, then the NUL terminated names
+ *
+ */
+static int build_snapshot(struct mg_iobuf *img)
+{
+    SnapshotHeader header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = serialization_ver,
+        .journal_gen = journal_gen,
+        .next_id = FileNode_next_id,
+    };
+
+    // the header is rewritten once the count and checksum are known
+    mg_iobuf_add(img, img->len, &header, sizeof(header));
+
+    for (int i = 0; i < FileNode_off; i++)
+    {
+        if (FileNodeList[i].is_del)
+        {
+            // ignore if the FileNode marked as delete
+            continue;
+        }
+
+        SnapshotRecord record = {
+            .id = FileNodeList[i].id,
+            .pwd = FileNodeList[i].pwd,
+            .file_size = FileNodeList[i].file_size,
+            .expire_time = FileNodeList[i].expire_time,
+            .name_off = header.names_len,
+        };
+        memcpy(record.digest, FileNodeList[i].digest, sizeof(record.digest));
+
+        mg_iobuf_add(img, img->len, &record, sizeof(record));
+        header.names_len += strlen(FileNodeList[i].file_name) + 1; // +1 for null terminator
+        header.count++;
+    }
+
+    for (int i = 0; i < FileNode_off; i++)
+    {
+        if (FileNodeList[i].is_del)
+            continue;
+
+        debug("serialize filename: %s\n", FileNodeList[i].file_name);
+
+        mg_iobuf_add(img, img->len, FileNodeList[i].file_name, strlen(FileNodeList[i].file_name) + 1);
+    }
+
+    if (img->len != sizeof(header) + header.count * sizeof(SnapshotRecord) + header.names_len)
+    {
+        fprintf(stderr, "Failed to buffer snapshot\n");
+        mg_iobuf_free(img);
+        return -1;
+    }
+
+    header.crc = mg_crc32(0, (char *)img->buf + sizeof(header), img->len - sizeof(header));
+    memcpy(img->buf, &header, sizeof(header));
+    return 0;
+}
+
+/*
+ * the snapshot is written aside and renamed in, so a crash never leaves a torn dump
+ *
+ */
+static int write_snapshot(const struct mg_iobuf *img)
+{
+    char tmp_path[sizeof(dump_dist) + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", dump_dist);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file)
+    {
+        perror("Failed to open file for writing");
+        return -1;
+    }
+
+    if (fwrite(img->buf, 1, img->len, file) != img->len || fflush(file) != 0 || fsync(fileno(file)) != 0)
+    {
+        perror("Failed to flush snapshot");
+        fclose(file);
+        unlink(tmp_path);
+        return -1;
+    }
+    fclose(file);
+
+    if (rename(tmp_path, dump_dist) != 0)
+    {
+        perror("Failed to replace snapshot");
+        return -1;
+    }
+
+    printf("file node list serialized to: %s\n", dump_dist);
+    return 0; // Success
+}
+
+int serialize_FileNodeList()
+{
+    struct mg_iobuf img = {NULL, 0, 0, JOURNAL_BUF_ALIGN};
+    int ret = build_snapshot(&img);
+
+    if (ret == 0)
+        ret = write_snapshot(&img);
+    mg_iobuf_free(&img);
+    return ret;
+}
+
+/*
+ * journal: every add/expire/delete since the last snapshot, appended as
+ *   [u32 length][u32 crc32][u8 type][int id][size_t size][time_t expire][u32 pwd][digest][name]
+ * records are batched in journal_buf and written + fdatasync'd by journal_worker
+ *
+ */
+void journal_append(unsigned char type, const FileNode *node)
+{
+    uint32_t name_len = type == JOURNAL_ADD ? strlen(node->file_name) : 0;
+    uint32_t len = sizeof(type) + sizeof(node->id) + sizeof(node->file_size) +
+                   sizeof(node->expire_time) + sizeof(node->pwd) + sizeof(node->digest) + name_len;
+    uint32_t crc = 0;
+
+    pthread_mutex_lock(&journal_lock);
+
+    if (journal_fd >= 0)
+    {
+        size_t ofs = journal_buf.len;
+
+        mg_iobuf_add(&journal_buf, journal_buf.len, &len, sizeof(len));
+        mg_iobuf_add(&journal_buf, journal_buf.len, &crc, sizeof(crc));
+        mg_iobuf_add(&journal_buf, journal_buf.len, &type, sizeof(type));
+        mg_iobuf_add(&journal_buf, journal_buf.len, &node->id, sizeof(node->id));
+        mg_iobuf_add(&journal_buf, journal_buf.len, &node->file_size, sizeof(node->file_size));
+        mg_iobuf_add(&journal_buf, journal_buf.len, &node->expire_time, sizeof(node->expire_time));
+        mg_iobuf_add(&journal_buf, journal_buf.len, &node->pwd, sizeof(node->pwd));
+        mg_iobuf_add(&journal_buf, journal_buf.len, node->digest, sizeof(node->digest));
+        mg_iobuf_add(&journal_buf, journal_buf.len, node->file_name, name_len);
+
+        if (journal_buf.len == ofs + 2 * sizeof(uint32_t) + len)
+        {
+            crc = mg_crc32(0, (char *)journal_buf.buf + ofs + 2 * sizeof(uint32_t), len);
+            memcpy(journal_buf.buf + ofs + sizeof(uint32_t), &crc, sizeof(crc));
+            pthread_cond_signal(&journal_cond);
+        }
+        else
+        {
+            fprintf(stderr, "Failed to buffer journal record\n");
+            journal_buf.len = ofs;
+        }
+    }
+
+    pthread_mutex_unlock(&journal_lock);
+}
+
+static int write_journal(const unsigned char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(journal_fd, buf, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to write journal");
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        journal_size += n;
+    }
+
+    if (fdatasync(journal_fd) != 0)
+    {
+        perror("Failed to sync journal");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * truncate the journal and stamp it with the current generation
+ * flags is JOURNAL_CLEAN only for the final compaction on shutdown
+ *
+ */
+static int reset_journal(uint32_t flags)
+{
+    uint32_t magic = JOURNAL_MAGIC;
+    unsigned char header[sizeof(magic) + sizeof(flags) + sizeof(journal_gen)];
+
+    memcpy(header, &magic, sizeof(magic));
+    memcpy(header + sizeof(magic), &flags, sizeof(flags));
+    memcpy(header + sizeof(magic) + sizeof(flags), &journal_gen, sizeof(journal_gen));
+
+    if (ftruncate(journal_fd, 0) != 0)
+    {
+        perror("Failed to truncate journal");
+        return -1;
+    }
+
+    journal_size = 0;
+    return write_journal(header, sizeof(header));
+}
+
+/*
+ * fold the journal into a fresh snapshot
+ * caller holds journal_io_lock, so no batch is being written meanwhile
+ *
+ * the table is copied out under the locks, the snapshot is written and fsync'd
+ * without them, records appended in the meantime stay queued for the new journal
+ *
+ */
+int compact_journal(uint32_t flags)
+{
+    struct mg_iobuf img = {NULL, 0, 0, JOURNAL_BUF_ALIGN};
+    size_t ofs;
+    int ret;
+
+    pthread_rwlock_rdlock(&FileNode_lock);
+    pthread_mutex_lock(&journal_lock);
+
+    // pending records are already reflected in FileNodeList
+    journal_gen++;
+    ofs = journal_buf.len;
+    ret = build_snapshot(&img);
+
+    pthread_mutex_unlock(&journal_lock);
+    pthread_rwlock_unlock(&FileNode_lock);
+
+    if (ret == 0)
+        ret = write_snapshot(&img);
+    mg_iobuf_free(&img);
+
+    pthread_mutex_lock(&journal_lock);
+    if (ret == 0)
+        mg_iobuf_del(&journal_buf, 0, ofs);
+    else
+        journal_gen--;
+    pthread_mutex_unlock(&journal_lock);
+
+    if (ret == 0)
+        ret = reset_journal(flags);
+
+    debug("journal compacted into generation %lu", (unsigned long)journal_gen);
+    return ret;
+}
+
+/*
+ * group commit: every record that arrived while the previous batch was syncing
+ * goes out with a single write and fdatasync
+ *
+ */
+void *journal_worker()
+{
+    struct mg_iobuf batch = {NULL, 0, 0, JOURNAL_BUF_ALIGN};
+
+    for (;;)
+    {
+        pthread_mutex_lock(&journal_lock);
+        while (journal_buf.len == 0 && !service_should_stop)
+            pthread_cond_wait(&journal_cond, &journal_lock);
+        pthread_mutex_unlock(&journal_lock);
+
+        if (service_should_stop)
+            break;
+
+        pthread_mutex_lock(&journal_io_lock);
+
+        pthread_mutex_lock(&journal_lock);
+        struct mg_iobuf tmp = journal_buf;
+        journal_buf = batch;
+        batch = tmp;
+        pthread_mutex_unlock(&journal_lock);
+
+        if (batch.len > 0)
+            write_journal(batch.buf, batch.len);
+        batch.len = 0;
+
+        if (journal_size > JOURNAL_COMPACT_BYTE)
+            compact_journal(0);
+
+        pthread_mutex_unlock(&journal_io_lock);
+    }
+
+    mg_iobuf_free(&batch);
+    return NULL;
+}
+
+/*
+ * map the snapshot and index its records in place, names keep pointing into the mapping
+ * Returns: 1 if the snapshot is missing a valid header, version or checksum
+ *
+ */
+static int load_snapshot()
+{
+    struct stat st;
+    int fd = open(dump_dist, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader))
+    {
+        fprintf(stderr, "dist dump %s is truncated\n", dump_dist);
+        close(fd);
+        return 1;
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("Failed to map snapshot");
+        return 1;
+    }
+
+    const SnapshotHeader *header = (const SnapshotHeader *)map;
+    const SnapshotRecord *records = (const SnapshotRecord *)(header + 1);
+    const char *names = (const char *)(records + header->count);
+
+    // check for version mismatched
+    if (header->magic != SNAPSHOT_MAGIC || header->version != serialization_ver)
+    {
+        fprintf(stderr, "dist dump version %u mismatched with %d\n",
+                header->magic == SNAPSHOT_MAGIC ? header->version : 0, serialization_ver);
+        munmap(map, st.st_size);
+        return 1;
+    }
+
+    if (sizeof(*header) + (uint64_t)header->count * sizeof(*records) + header->names_len != (uint64_t)st.st_size ||
+        (header->names_len && names[header->names_len - 1] != '\0') ||
+        mg_crc32(0, (const char *)records, st.st_size - sizeof(*header)) != header->crc)
+    {
+        fprintf(stderr, "dist dump %s is corrupted\n", dump_dist);
+        munmap(map, st.st_size);
+        return 1;
+    }
+
+    snapshot_map = map;
+    snapshot_len = st.st_size;
+    journal_gen = header->journal_gen;
+    FileNode_next_id = header->next_id;
+
+    // size the list once instead of growing it record by record
+    if (!FileNodeList && header->count > FILENODEPERMALLOC)
+    {
+        FileNodeList = malloc(sizeof(FileNode) * header->count);
+        FileNode_max = FileNodeList ? header->count : 0;
+    }
+
+    // nothing else runs yet: one lock for the whole table, and the deadlines go
+    // straight into the cleaner's heap, built at once instead of pushed one by one
+    HeapEntry *deadlines = malloc(sizeof(HeapEntry) * (header->count ? header->count : 1));
+    size_t deadline_num = 0;
+
+    pthread_rwlock_wrlock(&FileNode_lock);
+
+    for (uint32_t i = 0; i < header->count; ++i)
+    {
+        if (records[i].name_off >= header->names_len)
+            continue;
+
+        // records and nodes differ in layout, the names are used in place
+        FileNode node = {
+            .id = records[i].id,
+            .is_del = 0,
+            .file_name = (char *)names + records[i].name_off,
+            .file_size = records[i].file_size,
+            .expire_time = records[i].expire_time,
+            .pwd = records[i].pwd,
+        };
+        memcpy(node.digest, records[i].digest, sizeof(node.digest));
+
+        // ids were resolved to their blob when the node was added
+        if (append_FileNode(node) != 0)
+            continue;
+        ref_Blob(&node);
+
+        if (deadlines)
+            deadlines[deadline_num++] = (HeapEntry){.key = node.expire_time, .value = FileNode_off - 1};
+        else
+            post_cleaner(&schedule_queue, node.expire_time, FileNode_off - 1, node.id);
+    }
+
+    pthread_rwlock_unlock(&FileNode_lock);
+
+    if (deadlines && minheap_build(expiry_heap, deadlines, deadline_num) != 0)
+    {
+        for (size_t i = 0; i < deadline_num; ++i)
+            post_cleaner(&schedule_queue, deadlines[i].key, deadlines[i].value, -1);
+    }
+    free(deadlines);
+
+    return 0;
+}
+
+// storage id -> FileNodeList offset + 1 for the live nodes
+static Hashmap *index_FileNode_ids()
+{
+    Hashmap *ids = createHashmap(FileNode_num * 2);
+
+    for (int i = 0; ids && i < FileNode_off; ++i)
+    {
+        if (!FileNodeList[i].is_del)
+            hashmap_insert(ids, FileNodeList[i].id, (void *)(intptr_t)(i + 1));
+    }
+
+    return ids;
+}
+
+/*
+ * replayed records find their node by pickup code, it is unique among live nodes
+ *
+ */
+static void recover_add(FileNode node)
+{
+    // a record replayed over a snapshot that already holds it
+    if (get_FileNode(node.pwd))
+    {
+        free(node.file_name);
+        return;
+    }
+
+    node.is_del = 0;
+    if (add_FileNode(node) != 0)
+        free(node.file_name);
+}
+
+static void recover_remove(FileNode record)
+{
+    FileNode *node = get_FileNode(record.pwd);
+    if (!node || node->id != record.id)
+        return;
+
+    FileNode_num--;
+    node->is_del = 1;
+    hashmap_delete(FileNode_hashmap, node->pwd);
+    unref_Blob(node);
+}
+
+/*
+ * apply the journal written since the snapshot, up to the first torn or corrupt record
+ * Returns: number of records applied, *crashed is cleared only after a clean shutdown
+ *
+ */
+static int replay_journal(int *crashed)
+{
+    FILE *file = fopen(journal_dist, "rb");
+    if (!file)
+        return 0;
+
+    uint32_t magic, flags, len, crc;
+    uint64_t gen;
+    int applied = 0;
+    char record[JOURNAL_RECORD_MAX];
+
+    if (fread(&magic, sizeof(magic), 1, file) != 1 || magic != JOURNAL_MAGIC ||
+        fread(&flags, sizeof(flags), 1, file) != 1 || fread(&gen, sizeof(gen), 1, file) != 1)
+    {
+        fclose(file);
+        return 0;
+    }
+
+    *crashed = !(flags & JOURNAL_CLEAN);
+
+    // a journal from another generation is already folded into the snapshot
+    if (gen != journal_gen)
+    {
+        fclose(file);
+        return 0;
+    }
+
+    while (fread(&len, sizeof(len), 1, file) == 1 && fread(&crc, sizeof(crc), 1, file) == 1)
+    {
+        FileNode node = {0};
+        unsigned char type;
+        size_t fixed = sizeof(type) + sizeof(node.id) + sizeof(node.file_size) +
+                       sizeof(node.expire_time) + sizeof(node.pwd) + sizeof(node.digest);
+
+        if (len < fixed || len >= sizeof(record) || fread(record, 1, len, file) != len ||
+            mg_crc32(0, record, len) != crc)
+        {
+            fprintf(stderr, "journal: dropping torn record after %d records\n", applied);
+            break;
+        }
+
+        char *p = record;
+        memcpy(&type, p, sizeof(type)), p += sizeof(type);
+        memcpy(&node.id, p, sizeof(node.id)), p += sizeof(node.id);
+        memcpy(&node.file_size, p, sizeof(node.file_size)), p += sizeof(node.file_size);
+        memcpy(&node.expire_time, p, sizeof(node.expire_time)), p += sizeof(node.expire_time);
+        memcpy(&node.pwd, p, sizeof(node.pwd)), p += sizeof(node.pwd);
+        memcpy(node.digest, p, sizeof(node.digest)), p += sizeof(node.digest);
+
+        // a deleted blob needs nothing, files no node uses go with the orphans
+        if (type == JOURNAL_ADD)
+        {
+            node.file_name = strndup(p, len - fixed);
+            recover_add(node);
+        }
+        else if (type == JOURNAL_EXPIRE)
+        {
+            recover_remove(node);
+        }
+        applied++;
+    }
+
+    fclose(file);
+    return applied;
+}
+
+/*
+ * remove storage files no node references: expired, never finalized, or lost with a crash
+ *
+ */
+static int sweep_orphans(Hashmap *ids)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char filepath[325];
+
+    if ((dir = opendir(storage_dir)) == NULL)
+    {
+        perror("opendir");
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9' ||
+            strspn(entry->d_name, "0123456789") != strlen(entry->d_name) ||
+            hashmap_search(ids, atoi(entry->d_name)))
+            continue;
+
+        sprintf(filepath, "%s/%s", storage_dir, entry->d_name);
+        printf("remove orphaned file: %s\n", filepath);
+        unlink(filepath);
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+/*
+ * load the snapshot and replay the journal on top of it, then reopen the journal
+ * storage ids are stable, so files stay where they are; the storage directory
+ * is only walked when the last run did not shut down cleanly
+ *
+ */
+int deserialize_FileNodeList()
+{
+    Hashmap *ids;
+    int ret, replayed, crashed = 1;
+
+    if (load_snapshot() != 0)
+    {
+        // keep the files, the dump will be replaced by a compatible one
+        crashed = 0;
+        replayed = 0;
+        restore_SessionList();
+    }
+    else
+    {
+        replayed = replay_journal(&crashed);
+        restore_SessionList();
+
+        if (crashed)
+        {
+            if ((ids = index_FileNode_ids()) == NULL)
+            {
+                perror("Failed to allocate memory for recovery");
+                return -1;
+            }
+
+            // staging files of restored sessions are not orphans
+            for (int i = 0; i < session_max_count; ++i)
+            {
+                if (SessionList[i].sid != -1)
+                    hashmap_put(ids, SessionList[i].file_node.id, (void *)SessionList);
+            }
+
+            sweep_orphans(ids);
+            freeHashmap(ids);
+        }
+    }
+
+    printf("file node list deserialized from: %s with size %d, %d journal records replayed\n",
+           dump_dist, FileNode_num, replayed);
+
+    journal_fd = open(journal_dist, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (journal_fd < 0)
+    {
+        perror("Failed to open journal");
+        return -1;
+    }
+
+    // fold what was replayed into a new generation, otherwise just mark the journal in use
+    pthread_mutex_lock(&journal_io_lock);
+    ret = crashed || replayed ? compact_journal(0) : reset_journal(0);
+    pthread_mutex_unlock(&journal_io_lock);
+
+    return ret;
+}
+
+/*
+ * Initialize config parameter
+ * Returns: 1 if something goes wrong
+ *
+ */
+int config_initialize()
+{
+    FILE *file = fopen(CONFIG_FILE, "r");
+    if (file == NULL)
+    {
+        perror("Error opening config file");
+        return 1;
+    }
+
+    char line[128];
+
+    size_t config_count = 0;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        if (sscanf(line, "file_max_byte:%d", &file_max_byte) == 1)
+        {
+            config_count++;
+        }
+        else if (sscanf(line, "file_max_count:%d", &file_max_count) == 1)
+        {
+            config_count++;
+        }
+        else if (sscanf(line, "file_expire:%d", &file_expire) == 1)
+        {
+            config_count++;
+        }
+        else if (sscanf(line, "worker_period:%d", &worker_period_minute) == 1)
+        {
+            config_count++;
+        }
+        else if (sscanf(line, "storage_dir:%s", storage_dir) == 1)
+        {
+            config_count++;
+        }
+        else if (sscanf(line, "dump_dist:%s", dump_dist) == 1)
+        {
+            config_count++;
+        }
+        else if (sscanf(line, "journal_dist:%s", journal_dist) == 1)
+        {
+            config_count++;
+        }
+        else if (sscanf(line, "session_max_count:%d", &session_max_count) == 1)
+        {
+            config_count++;
+        }
+        else if (sscanf(line, "session_expire:%d", &session_expire) == 1)
+        {
+            config_count++;
+        }
+        else if (sscanf(line, "workers:%d", &worker_count) == 1)
+        {
+            config_count++;
+        }
+        else if (sscanf(line, "cache_max_byte:%d", &cache_max_byte) == 1)
+        {
+            config_count++;
+        }
+        else if (sscanf(line, "send_rate:%d", &send_rate) == 1)
+        {
+            config_count++;
+        }
+        else if (sscanf(line, "conn_send_rate:%d", &conn_send_rate) == 1)
+        {
+            config_count++;
+        }
+        else if (sscanf(line, "recv_rate:%d", &recv_rate) == 1)
+        {
+            config_count++;
+        }
+        else if (sscanf(line, "conn_recv_rate:%d", &conn_recv_rate) == 1)
+        {
+            config_count++;
+        }
+        else if (sscanf(line, "io_uring:%d", &io_uring) == 1)
+        {
+            config_count++;
+        }
+        else
+        {
+            fprintf(stderr, "WARNING: invalid config line read: %s\n", line);
+        }
+    }
+    fclose(file);
+
+    if (config_count != CONFIG_NUM_EXPECT)
+    {
+        fprintf(stderr, "config load error, expect '%d' but have '%zu'\n", CONFIG_NUM_EXPECT, config_count);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * drop the nodes the cleaner found expired, runs on the first worker's event loop
+ * the files are handed back to the cleaner, the loop never waits on an unlink
+ *
+ */
+void expire_FileNodes()
+{
+    MpscNode *link;
+    int expired = 0;
+
+    while ((link = mpsc_pop(&expired_queue)))
+    {
+        ExpiryMsg *msg = mpsc_entry(link, ExpiryMsg, link);
+        int is_last = 0;
+
+        pthread_rwlock_wrlock(&FileNode_lock);
+
+        FileNode *node = FileNodeList + msg->off;
+
+        debug("file_id %d file_name %s expire %ld is_del %d",
+              node->id, node->file_name, node->expire_time, node->is_del);
+
+        if (!node->is_del)
+        {
+            FileNode_num--;
+            expired++;
+            node->is_del = 1;
+            hashmap_delete(FileNode_hashmap, node->pwd);
+            journal_append(JOURNAL_EXPIRE, node);
+            is_last = unref_Blob(node);
+            msg->id = node->id;
+
+            // no node can bring the content back into the cache now
+            if (is_last && download_cache)
+            {
+                pthread_mutex_lock(&cache_lock);
+                lru_delete(download_cache, node->id);
+                pthread_mutex_unlock(&cache_lock);
+            }
+
+            printf("removing expired (%ld) file: %s\n", time(NULL) - node->expire_time, node->file_name);
+        }
+
+        pthread_rwlock_unlock(&FileNode_lock);
+
+        // reuse the message for the unlink request, shared content stays
+        if (is_last)
+        {
+            mpsc_push(&unlink_queue, &msg->link);
+            sem_post(&cleaner_sem);
+        }
+        else
+        {
+            free(msg);
+        }
+    }
+
+    if (expired)
+    {
+        pthread_mutex_lock(&session_lock);
+        update_service_status();
+        pthread_mutex_unlock(&session_lock);
+    }
+}
+
+/*
+ * remove the storage files of expired nodes, on the cleaner thread
+ *
+ */
+static void unlink_expired()
+{
+    MpscNode *link;
+
+    while ((link = mpsc_pop(&unlink_queue)))
+    {
+        ExpiryMsg *msg = mpsc_entry(link, ExpiryMsg, link);
+        FileNode node = {.id = msg->id};
+        char filepath[160];
+
+        snprintf(filepath, sizeof(filepath), "%s/%d", storage_dir, msg->id);
+
+        if (unlink(filepath) != 0 && errno != ENOENT)
+            fprintf(stderr, "(Worker) Error deleting file %s: %s\n", filepath, strerror(errno));
+        else
+            journal_append(JOURNAL_DELETE, &node);
+
+        free(msg);
+    }
+}
+
+/*
+ * Worker to clean the expired files
+ * it owns the expiry index and only talks to the event loop through lock-free queues:
+ * new deadlines come in on schedule_queue, expired offsets go out on expired_queue,
+ * and the files to remove come back on unlink_queue
+ * sleeps until the earliest deadline, worker_period at most
+ *
+ */
+void *cleaner_worker()
+{
+    while (!service_should_stop)
     {
         debug("cleaner worker wake up");
-        if (FileNodeList)
+
+        MpscNode *link;
+        HeapEntry top;
+        time_t current_time = time(NULL);
+        uint64_t start_us = metrics_now_us();
+
+        while ((link = mpsc_pop(&schedule_queue)))
         {
-            time_t current_time;
-            time(&current_time);
-            char filepath[160];
+            ExpiryMsg *msg = mpsc_entry(link, ExpiryMsg, link);
+            minheap_push(expiry_heap, msg->expire_time, msg->off);
+            free(msg);
+        }
+
+        unlink_expired();
+
+        // only expired nodes are visited, O(log n) each
+        while (minheap_peek(expiry_heap, &top) == 0 && top.key <= current_time)
+        {
+            ExpiryMsg *msg = malloc(sizeof(ExpiryMsg));
+            if (!msg)
+                break; // retried on the next wake up
+
+            minheap_pop(expiry_heap, NULL);
+            msg->expire_time = top.key;
+            msg->off = top.value;
+            mpsc_push(&expired_queue, &msg->link);
+        }
+
+        struct timespec deadline = {.tv_sec = current_time + worker_period_minute * 60};
+        if (minheap_peek(expiry_heap, &top) == 0 && top.key < deadline.tv_sec)
+            deadline.tv_sec = top.key;
+
+        histogram_observe(&cleaner_run, metrics_now_us() - start_us);
+        debug("cleaner worker sleep");
+
+        // every message for the cleaner comes with a post
+        sem_timedwait(&cleaner_sem, &deadline);
+    }
+
+    return NULL;
+}
+
+/*
+ * terminate handler for interupt signal, the event loops notice within a poll period
+ *
+ */
+void terminate_handler(int sig)
+{
+    service_should_stop = 1;
+    (void)sig;
+}
+
+/*
+ * final cleanup, once every worker has left its event loop
+ *
+ */
+void cleanup()
+{
+    MpscNode *link;
+
+    sem_post(&cleaner_sem);
+    pthread_join(tid, NULL);
+    unlink_expired(); // requests the cleaner did not get to
+    printf("cleaner thread end\n");
+
+    // the nodes stay in the snapshot, they expire again on the next start
+    while ((link = mpsc_pop(&schedule_queue)) || (link = mpsc_pop(&expired_queue)))
+        free(mpsc_entry(link, ExpiryMsg, link));
+
+    for (int i = 0; i < worker_count; ++i)
+    {
+        mg_mgr_free(&WorkerList[i].mgr);
+        freeHashmap(WorkerList[i].subscribers);
+    }
+    free(WorkerList);
+    printf("server stoped\n");
+    pthread_mutex_lock(&journal_io_lock);
+    compact_journal(JOURNAL_CLEAN);
+    pthread_mutex_unlock(&journal_io_lock);
+    freeFileNodeList();
+    if (snapshot_map)
+        munmap(snapshot_map, snapshot_len);
+    freeSessionList();
+    freeHashmap(FileNode_hashmap);
+    freeBlobs();
+    freeLruCache(download_cache);
+    freeHashmap(Session_hashmap);
+    freeMinHeap(expiry_heap);
+    freeTrie(route_trie);
+    sem_destroy(&cleaner_sem);
+    printf("bye\n");
+}
+
+ROUTER(index_page)
+{
+
+    // Cache all image request
+    char uri[hm->uri.len + 1];
+    strncpy(uri, hm->uri.buf, hm->uri.len);
+    uri[hm->uri.len] = '\0';
+
+    debug("request: %s", uri);
+
+    struct mg_http_serve_opts opts = {.root_dir = "assets", .page404 = "assets/index.html"};
+
+#ifndef DEBUG
+    if (check_file_with_exts(uri, cached_exts))
+    {
+        debug("cache file: %s", uri);
+        opts.extra_headers = "Cache-Control: max-age=259200\n";
+    }
+#else
+    (void)cached_exts; // disable warning
+#endif
+
+    mg_http_serve_dir(c, hm, &opts); // Serve static files
+}
+
+ROUTER(apply)
+{
+    UploadSession *session = NULL;
+
+    pthread_mutex_lock(&session_lock);
+
+    FileNode_read_lock();
+    int is_full = FileNode_num + Session_num >= file_max_count;
+    FileNode_read_unlock();
+
+    if (!is_full)
+        session = create_Session();
+
+    if (session)
+    {
+        mg_http_reply(c, 200, "", "{%m: %d, %m: %d}\n",
+                      MG_ESC("status"), 1,
+                      MG_ESC("code"), session->sid);
+    }
+    else
+    {
+        mg_http_reply(c, 501, "", "{%m: %d, %m: %m}\n",
+                      MG_ESC("status"), 0,
+                      MG_ESC("code"), MG_ESC("Service is busy"));
+    }
+
+    pthread_mutex_unlock(&session_lock);
+}
+
+/*
+ * validate an upload request and get its session ready for the body, caller holds session_lock
+ * Returns: the session, or NULL if an error reply has been sent
+ *
+ */
+UploadSession *prepare_upload(struct mg_connection *c, struct mg_http_message *hm, size_t *offset)
+{
+    FileNode_read_lock();
+    int is_full = FileNode_num >= file_max_count;
+    FileNode_read_unlock();
+
+    if (is_full)
+    {
+        mg_http_reply(c, 503, "", "{%m: %d, %m: %m}\n",
+                      MG_ESC("status"), 0,
+                      MG_ESC("code"), MG_ESC("Service is Unavailable"));
+        return NULL;
+    }
+
+    char buf[32];
+    int ret = mg_http_get_var(&hm->query, "sid", buf, sizeof(buf));
+    UploadSession *session;
+
+    if (ret <= 0)
+    {
+        mg_http_reply(c, 400, "", "Wrong Request");
+        return NULL;
+    }
+
+    if (!(session = get_Session(atoi(buf))))
+    {
+        mg_http_reply(c, 501, "", "Wrong SID");
+        return NULL;
+    }
+
+    long off = 0;
+    if (mg_http_get_var(&hm->query, "offset", buf, sizeof(buf)) > 0)
+        off = strtol(buf, NULL, 0);
+
+    if (hm->body.len == 0)
+    {
+        *offset = session->committed; // Nothing to write
+        return session;
+    }
+
+    if (off < 0)
+        mg_http_reply(c, 400, "", "offset required");
+    else if ((size_t)off + hm->body.len > (size_t)file_max_byte)
+        mg_http_reply(c, 400, "", "over max size of %d", file_max_byte);
+    else
+    {
+        *offset = off;
+        return session;
+    }
+
+    free_Session(session, 0);
+    return NULL;
+}
+
+ROUTER(upload)
+{
+    UploadSession *session;
+    size_t offset;
+
+    pthread_mutex_lock(&session_lock);
+
+    if (!(session = prepare_upload(c, hm, &offset)))
+    {
+        pthread_mutex_unlock(&session_lock);
+        return;
+    }
+
+    if (write_Session(&session, offset, hm->body.buf, hm->body.len) != 0)
+        mg_http_reply(c, 400, "", "write: %d", errno);
+    else if (session)
+        mg_http_reply(c, 200, "", "%ld", (long)session->committed);
+    else
+        mg_http_reply(c, 501, "", "Wrong SID"); // finalized or dropped while writing
+
+    pthread_mutex_unlock(&session_lock);
+}
+
+/*
+ * read a whole blob for the download cache, from a file opened under the FileNode read lock
+ * Returns: malloc'd content, NULL if the file does not match the node
+ *
+ */
+char *load_cached(const FileNode *node, int fd, time_t *mtime)
+{
+    struct stat st;
+    char *data = fstat(fd, &st) == 0 ? malloc(node->file_size ? node->file_size : 1) : NULL;
+    size_t off = 0;
+
+    while (data && off < node->file_size)
+    {
+        ssize_t n = pread(fd, data + off, node->file_size - off, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        off += n;
+    }
+
+    if (off != node->file_size)
+    {
+        free(data);
+        return NULL;
+    }
+    *mtime = st.st_mtime;
+    return data;
+}
+
+/*
+ * the validators of a cached blob, the Etag is the one mg_http_serve_file
+ * computes for the storage file, so either path can answer If-None-Match
+ *
+ */
+static void describe_cached(LruEntry *entry, const FileNode *node, time_t mtime)
+{
+    struct tm tm;
+
+    mg_http_etag(entry->etag, sizeof(entry->etag), node->file_size, mtime);
+    strftime(entry->last_modified, sizeof(entry->last_modified), "%a, %d %b %Y %H:%M:%S GMT",
+             gmtime_r(&mtime, &tm));
+}
+
+/*
+ * queue a cached blob as a 200 reply, or a 304 if the client has it, caller holds cache_lock
+ * nodes sharing a blob may carry different names, the type comes from the node
+ *
+ */
+static void send_cached(struct mg_connection *c, struct mg_http_message *hm, const FileNode *node,
+                        const LruEntry *entry, const char *extra_header)
+{
+    struct mg_str mime = mg_http_guess_content_type(mg_str(node->file_name), NULL);
+    struct mg_str *inm = mg_http_get_header(hm, "If-None-Match");
+    int fresh = inm && mg_strcasecmp(*inm, mg_str(entry->etag)) == 0;
+
+    mg_printf(c,
+              "HTTP/1.1 %s\r\n"
+              "Content-Type: %.*s\r\n"
+              "Etag: %s\r\n"
+              "Last-Modified: %s\r\n"
+              "Content-Length: %lu\r\n"
+              "%s\r\n",
+              fresh ? "304 Not Modified" : "200 OK", (int)mime.len, mime.buf, entry->etag,
+              entry->last_modified, fresh ? 0UL : (unsigned long)entry->len, extra_header);
+
+    if (!fresh && mg_strcasecmp(hm->method, mg_str("HEAD")) != 0)
+        mg_send(c, entry->data, entry->len);
+    c->is_resp = 0; // the whole reply is queued, let the next request on the connection in
+}
+
+// small downloads are served from memory, ranges are left to mongoose
+static int is_cacheable(struct mg_http_message *hm, const FileNode *node)
+{
+    return download_cache && node->file_size <= CACHE_FILE_MAX_BYTE && !mg_http_get_header(hm, "Range");
+}
+
+/*
+ * serve a download from the cache if it is there, caller holds the FileNode read lock
+ * Returns: 1 if the reply has been queued
+ *
+ */
+int serve_cached(struct mg_connection *c, struct mg_http_message *hm, const FileNode *node,
+                 const char *extra_header)
+{
+    // entries are copied out under the lock, another worker may evict them
+    pthread_mutex_lock(&cache_lock);
+    LruEntry *entry = lru_get(download_cache, node->id);
+    if (entry)
+        send_cached(c, hm, node, entry, extra_header);
+    pthread_mutex_unlock(&cache_lock);
+
+    return entry != NULL;
+}
+
+/*
+ * on a miss, read the blob without any lock and serve it from the cache; node is a copy
+ * and fd was opened while the node was live. The blob is only cached if it still is:
+ * expiring its last node empties the cache under the write lock, an entry put after
+ * that would outlive it
+ * Returns: 1 if the reply has been queued, 0 to fall back to mg_http_serve_file
+ *
+ */
+int fill_cached(struct mg_connection *c, struct mg_http_message *hm, const FileNode *node, int fd,
+                const char *extra_header)
+{
+    LruEntry *entry = NULL;
+    time_t mtime;
+    char *data = load_cached(node, fd, &mtime);
+    if (!data)
+        return 0;
+
+    FileNode_read_lock();
+    Blob *blob = get_Blob(node->digest);
+
+    pthread_mutex_lock(&cache_lock);
+    if (blob && blob->id == node->id && (entry = lru_put(download_cache, node->id, data, node->file_size)))
+    {
+        describe_cached(entry, node, mtime);
+        send_cached(c, hm, node, entry, extra_header);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    FileNode_read_unlock();
+    free(data);
+    return entry != NULL;
+}
+
+ROUTER(download)
+{
+    char buf[32];
+    int ret = mg_http_get_var(&hm->query, "pass", buf, sizeof(buf));
+    struct mg_http_serve_opts opts = {};
+    FileNode *filenode, node;
+    char local_path[64], *extra_header;
+    int fd = -1, is_hit = 0;
+
+    // the node stays put until the file is opened, the cleaner can unlink it afterwards
+    FileNode_read_lock();
+
+    if (!(filenode = get_FileNode(atoi(buf))))
+    {
+        mg_http_reply(c, 404, "", "");
+        FileNode_read_unlock();
+        return;
+    }
+
+    extra_header = malloc(128);
+    printf("request download file: %s\n", filenode->file_name);
+    sprintf(extra_header, "Content-Disposition: attachment; filename=%s\n", filenode->file_name);
+    opts.extra_headers = extra_header;
+    sprintf(local_path, "%s/%d", storage_dir, filenode->id);
+
+    if (is_cacheable(hm, filenode) && !(is_hit = serve_cached(c, hm, filenode, extra_header)))
+    {
+        // misses are read after the lock is dropped, finalizers and the cleaner are not held up
+        node = *filenode;
+        if ((node.file_name = strdup(filenode->file_name)) && (fd = open(local_path, O_RDONLY | O_CLOEXEC)) < 0)
+            free(node.file_name);
+    }
+
+    if (!is_hit && fd < 0)
+        mg_http_serve_file(c, hm, local_path, &opts);
+    FileNode_read_unlock();
+
+    if (fd >= 0)
+    {
+        // a file that expired meanwhile is gone from disk, that is a 404 then
+        if (!fill_cached(c, hm, &node, fd, extra_header))
+            mg_http_serve_file(c, hm, local_path, &opts);
+        close(fd);
+        free(node.file_name);
+    }
+    free(extra_header);
+}
+
+// %M printer for the received ranges of a session, as a JSON array of [start, end)
+static size_t print_ranges(void (*out)(char, void *), void *arg, va_list *ap)
+{
+    UploadSession *session = va_arg(*ap, UploadSession *);
+    size_t n = 0;
+
+    for (int i = 0; i < session->range_num; ++i)
+        n += mg_xprintf(out, arg, "%s[%lu, %lu]", i ? ", " : "",
+                        (unsigned long)session->ranges[i].start, (unsigned long)session->ranges[i].end);
+    return n;
+}
 
-            for (int i = 0; i < FileNode_off; ++i)
-            {
-                debug("file_id %d file_name %s expire %ld current %ld is_del %d",
-                      FileNodeList[i].id, FileNodeList[i].file_name, FileNodeList[i].expire_time, current_time, FileNodeList[i].is_del);
-
-                if (FileNodeList[i].is_del == 0 && FileNodeList[i].expire_time <= current_time)
-                {
-                    snprintf(filepath, sizeof(filepath), "%s/%d", storage_dir, FileNodeList[i].id);
-
-                    if (unlink(filepath) != 0)
-                    {
-                        fprintf(stderr, "(Worker) Error deleting file %s: %s\n", FileNodeList[i].file_name, strerror(errno));
-                    }
-                    else
-                    {
-                        printf("(Worker) removing expired (%ld) file: %s\n", current_time - FileNodeList[i].expire_time, FileNodeList[i].file_name);
-                    }
-                    FileNode_num--;
-                    FileNodeList[i].is_del = 1;
-
-                    // ensure the file to delete match and ensure we can assert item not exist
-                    // if cannot find its key in hashmap.
-                    FileNode *target = hashmap_search(FileNode_hashmap, FileNodeList[i].pwd);
-                    if (target && target->pwd == FileNodeList[i].pwd)
-                        hashmap_delete(FileNode_hashmap, FileNodeList[i].pwd);
-                }
-            }
-        }
+ROUTER(upload_status)
+{
+    char buf[32];
+    UploadSession *session;
 
-        debug("cleaner worker sleep");
+    pthread_mutex_lock(&session_lock);
 
-        // sleep untile another period
-        sleep(worker_period_minute * 60);
+    if (mg_http_get_var(&hm->query, "sid", buf, sizeof(buf)) > 0 && (session = get_Session(atoi(buf))))
+    {
+        mg_http_reply(c, 200, "", "{%m: %d, %m: %lu, %m: [%M]}\n",
+                      MG_ESC("status"), 1,
+                      MG_ESC("committed"), (unsigned long)session->committed,
+                      MG_ESC("ranges"), print_ranges, session);
+    }
+    else
+    {
+        mg_http_reply(c, 404, "", "{%m: %d, %m: %m}\n",
+                      MG_ESC("status"), 0,
+                      MG_ESC("code"), MG_ESC("Wrong SID"));
     }
 
-    return NULL;
+    pthread_mutex_unlock(&session_lock);
 }
 
 /*
- * terminate handler for interupt signal and final cleanup
+ * an upload is complete once its chunks cover [0, size) without a gap,
+ * size is the length the client declares to the finalizer and is required:
+ * without it a finalizer sent early would pass off a prefix as the whole file.
+ * An empty file is complete only when size=0 is given and no byte arrived
  *
  */
-void terminate_handler()
-{
-    service_should_stop = 1;
-    printf("cleaner thread end\n");
-    mg_mgr_free(&mgr);
-    printf("server stoped\n");
-    serialize_FileNodeList();
-    freeFileNodeList();
-    freeHashmap(FileNode_hashmap);
-    freeHashmap(ws_timer_hashmap);
-    printf("bye\n");
-    exit(0);
-}
-
-ROUTER(index_page)
+int is_complete(UploadSession *session, struct mg_http_message *hm)
 {
+    char buf[32], *end;
+    long size;
 
-    // Cache all image request
-    char uri[hm->uri.len + 1];
-    strncpy(uri, hm->uri.buf, hm->uri.len);
-    uri[hm->uri.len] = '\0';
+    if (mg_http_get_var(&hm->query, "size", buf, sizeof(buf)) <= 0)
+        return 0;
 
-    debug("request: %s", uri);
+    size = strtol(buf, &end, 10);
+    if (end == buf || *end != '\0' || size < 0 || size > file_max_byte)
+        return 0;
 
-    struct mg_http_serve_opts opts = {.root_dir = "assets", .page404 = "assets/index.html"};
+    // a chunk still being written may run past size
+    if (session->claim_num > 0)
+        return 0;
 
-#ifndef DEBUG
-    if (check_file_with_exts(uri, cached_exts))
-    {
-        debug("cache file: %s", uri);
-        opts.extra_headers = "Cache-Control: max-age=259200\n";
-    }
-#else
-    (void)cached_exts; // disable warning
-#endif
+    if (session->range_num == 0)
+        return size == 0;
 
-    mg_http_serve_dir(c, hm, &opts); // Serve static files
+    // an empty chunk leaves [0, 0) behind, which only an empty file matches
+    return session->range_num == 1 && session->ranges[0].start == 0 &&
+           session->ranges[0].end == (size_t)size && session->committed == (size_t)size;
 }
 
-ROUTER(apply)
+ROUTER(finalizer)
 {
-    if (sid_buf.sid == -1)
+    char buf[64];
+    UploadSession *session;
+    mg_http_get_var(&hm->query, "sid", buf, sizeof(buf));
+
+    // nodes are only added here, under session_lock, so the code checked below stays free
+    pthread_mutex_lock(&session_lock);
+
+    if (Session_num == 0)
     {
-        sid_buf.sid = generate_rand_6digit();
-        sid_buf.file_node = create_standby_FileNode();
-        mg_http_reply(c, 200, "", "{%m: %d, %m: %d}\n",
-                      MG_ESC("status"), 1,
-                      MG_ESC("code"), sid_buf.sid);
+        mg_http_reply(c, 400, "", "");
+    }
+    else if ((session = get_Session(atoi(buf))) && !is_complete(session, hm))
+    {
+        // missing chunks can still be sent
+        mg_http_reply(c, 400, "", "{%m: %d, %m: %m}\n",
+                      MG_ESC("status"), 0,
+                      MG_ESC("code"), MG_ESC("Upload incomplete"));
+    }
+    else if (session)
+    {
+        mg_http_get_var(&hm->query, "file", buf, sizeof(buf));
+        session->file_node.file_size = session->committed;
+        session->file_node.file_name = strdup(buf);
+
+        // another upload may have taken the staged code in the meantime
+        FileNode_read_lock();
+        int is_taken = get_FileNode(session->file_node.pwd) != NULL;
+        FileNode_read_unlock();
+
+        if (is_taken)
+            session->file_node.pwd = generate_unique_pwd();
+        mg_sha256_final(session->file_node.digest, &session->sha);
+
+        if (add_FileNode(session->file_node) == 0)
+        {
+            mg_http_reply(c, 200, "", "{%m: %d, %m: %d}\n",
+                          MG_ESC("status"), 1,
+                          MG_ESC("code"), session->file_node.pwd);
+
+            free_Session(session, 1);
+            printf("finalize upload file: %s\n", buf);
+        }
+        else
+        {
+            // nothing refers to the staged file, it goes with the session
+            mg_http_reply(c, 500, "", "{%m: %d, %m: %m}\n",
+                          MG_ESC("status"), 0,
+                          MG_ESC("code"), MG_ESC("Failed to save file"));
+
+            free(session->file_node.file_name);
+            free_Session(session, 0);
+        }
     }
     else
     {
         mg_http_reply(c, 501, "", "{%m: %d, %m: %m}\n",
                       MG_ESC("status"), 0,
-                      MG_ESC("code"), MG_ESC("Service is busy"));
+                      MG_ESC("code"), MG_ESC("Wrong Sid"));
     }
+
+    pthread_mutex_unlock(&session_lock);
 }
 
-ROUTER(upload)
+ROUTER(cache)
+{
+    LruCache empty = {0};
+
+    pthread_mutex_lock(&cache_lock);
+    LruCache *cache = download_cache ? download_cache : &empty;
+    mg_http_reply(c, 200, "", "{%m: %llu, %m: %llu, %m: %lu, %m: %lu, %m: %d}\n",
+                  MG_ESC("hits"), (unsigned long long)cache->hits,
+                  MG_ESC("misses"), (unsigned long long)cache->misses,
+                  MG_ESC("count"), (unsigned long)cache->count,
+                  MG_ESC("byte"), (unsigned long)cache->byte,
+                  MG_ESC("max_byte"), cache_max_byte);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+ROUTER(config)
+{
+    mg_http_reply(c, 200, "", "{%m: %d, %m: %d}\n",
+                  MG_ESC("file_max_byte"), file_max_byte,
+                  MG_ESC("file_expire"), file_expire);
+}
+
+// one histogram in the Prometheus text format
+static size_t print_histogram(void (*out)(char, void *), void *arg, const char *name, const char *labels,
+                              HistogramSum *sum)
 {
-    if (FileNode_num >= file_max_count)
+    const char *sep = *labels ? "," : "";
+    uint64_t total = 0;
+    size_t n = 0;
+
+    for (int i = 0; i < METRICS_BUCKETS; ++i)
     {
-        mg_http_reply(c, 503, "", "{%m: %d, %m: %m}\n",
-                      MG_ESC("status"), 0,
-                      MG_ESC("code"), MG_ESC("Service is Unavailable"));
-        return;
+        total += sum->bucket[i];
+        n += mg_xprintf(out, arg, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+                        metrics_bucket_us[i] / 1e6, (unsigned long long)total);
     }
+    n += mg_xprintf(out, arg, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long)sum->count);
+    n += mg_xprintf(out, arg, "%s_sum%s%s%s %g\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+                    sum->sum_us / 1e6);
+    n += mg_xprintf(out, arg, "%s_count%s%s%s %llu\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+                    (unsigned long long)sum->count);
+    return n;
+}
 
-    char buf[32];
-    int ret = mg_http_get_var(&hm->query, "sid", buf, sizeof(buf));
+// %M printer for the metrics page, sums the per worker counters
+static size_t print_metrics(void (*out)(char, void *), void *arg, va_list *ap)
+{
+    uint64_t byte_in = 0, byte_out = 0, accepted = 0, closed = 0;
+    HistogramSum lag = {0}, cleaner = {0};
+    char labels[32];
+    size_t n = 0;
 
-    if (ret <= 0)
-        mg_http_reply(c, 400, "", "Wrong Request");
+    (void)ap;
 
-    if (atoi(buf) == sid_buf.sid)
+    n += mg_xprintf(out, arg, "# TYPE filebay_request_duration_seconds histogram\n");
+    for (int route = 0; route < ROUTE_NUM; ++route)
     {
-        char filename[2] = {sid_buf.file_node.id + '0', '\0'};
-        sid_buf.file_node.file_size = mg_http_upload(c, hm, filename, &mg_fs_posix, storage_dir, file_max_byte);
+        HistogramSum sum = {0};
+        for (int i = 0; i < worker_count; ++i)
+            histogram_collect(&sum, WorkerList[i].metrics.request + route);
 
-        if (sid_buf.file_node.file_size < 0)
-        {
-            unlink(filename);
-            sid_buf.sid = -1;
-            return;
-        }
+        snprintf(labels, sizeof(labels), "router=\"%s\"", route_names[route]);
+        n += print_histogram(out, arg, "filebay_request_duration_seconds", labels, &sum);
     }
-    else
-        mg_http_reply(c, 501, "", "Wrong SID");
+
+    for (int i = 0; i < worker_count; ++i)
+    {
+        Metrics *metrics = &WorkerList[i].metrics;
+        histogram_collect(&lag, &metrics->loop_lag);
+        byte_in += counter_get(&metrics->byte_in);
+        byte_out += counter_get(&metrics->byte_out);
+        accepted += counter_get(&metrics->accepted);
+        closed += counter_get(&metrics->closed);
+    }
+    histogram_collect(&cleaner, &cleaner_run);
+
+    FileNode_read_lock();
+    int file_num = FileNode_num;
+    FileNode_read_unlock();
+
+    n += mg_xprintf(out, arg, "# TYPE filebay_loop_lag_seconds histogram\n");
+    n += print_histogram(out, arg, "filebay_loop_lag_seconds", "", &lag);
+    n += mg_xprintf(out, arg, "# TYPE filebay_cleaner_run_seconds histogram\n");
+    n += print_histogram(out, arg, "filebay_cleaner_run_seconds", "", &cleaner);
+    n += mg_xprintf(out, arg, "# TYPE filebay_received_bytes_total counter\nfilebay_received_bytes_total %llu\n",
+                    (unsigned long long)byte_in);
+    n += mg_xprintf(out, arg, "# TYPE filebay_sent_bytes_total counter\nfilebay_sent_bytes_total %llu\n",
+                    (unsigned long long)byte_out);
+    n += mg_xprintf(out, arg, "# TYPE filebay_connections_accepted_total counter\nfilebay_connections_accepted_total %llu\n",
+                    (unsigned long long)accepted);
+    n += mg_xprintf(out, arg, "# TYPE filebay_connections gauge\nfilebay_connections %lld\n",
+                    (long long)(accepted - closed));
+    n += mg_xprintf(out, arg, "# TYPE filebay_files gauge\nfilebay_files %d\n", file_num);
+    n += mg_xprintf(out, arg, "# TYPE filebay_storage_bytes gauge\nfilebay_storage_bytes %lld\n",
+                    (long long)atomic_load_explicit(&storage_byte, memory_order_relaxed));
+    return n;
 }
 
-ROUTER(download)
+ROUTER(metrics)
 {
-    char buf[32];
-    int ret = mg_http_get_var(&hm->query, "pass", buf, sizeof(buf));
-    struct mg_http_serve_opts opts = {};
-    FileNode *filenode;
+    mg_http_reply(c, 200, "Content-Type: text/plain; version=0.0.4\r\n", "%M", print_metrics);
+}
 
-    if ((filenode = get_FileNode(atoi(buf))))
-    {
-        char *extra_header = malloc(128);
-        printf("request download file: %s\n", filenode->file_name);
-        sprintf(extra_header, "Content-Disposition: attachment; filename=%s\n", filenode->file_name);
-        opts.extra_headers = extra_header;
+ROUTER(status)
+{
+    mg_ws_upgrade(c, hm, NULL);
+}
 
-        char local_path[64];
-        sprintf(local_path, "%s/%d", storage_dir, filenode->id);
+void send_status(struct mg_connection *c, int is_busy)
+{
+    char ret = is_busy + '0';
+    mg_ws_send(c, &ret, 1, WEBSOCKET_OP_TEXT);
+}
 
-        mg_http_serve_file(c, hm, local_path, &opts);
-        free(extra_header);
-    }
-    else
+/*
+ * push the busy state to this worker's /api/status subscribers if it changed since the last push
+ * runs on the worker's own loop, woken up by update_service_status
+ *
+ */
+void broadcast_status(Worker *worker)
+{
+    int is_busy = atomic_load(&service_busy);
+    if (is_busy == worker->busy_sent)
+        return;
+
+    worker->busy_sent = is_busy;
+    for (size_t i = 0; i < worker->subscribers->size; ++i)
     {
-        mg_http_reply(c, 404, "", "");
+        if (worker->subscribers->entries[i].dist)
+            send_status((struct mg_connection *)worker->subscribers->entries[i].value, is_busy);
     }
 }
 
-ROUTER(finalizer)
+/*
+ * streaming upload: take the body over from the HTTP parser once the headers
+ * are in, and drain c->recv to the staging file on every read
+ *
+ */
+void upload_stream_read(struct mg_connection *c)
 {
-    if (sid_buf.sid == -1)
+    UploadStream *us = (UploadStream *)c->fn_data;
+    size_t len = us->expected - us->received;
+
+    pthread_mutex_lock(&session_lock);
+    UploadSession *session = us->sid == -1 ? NULL : get_Session(us->sid);
+
+    if (len > c->recv.len)
+        len = c->recv.len;
+
+    if (session && len > 0 && write_Session(&session, us->offset + us->received, (char *)c->recv.buf, len) != 0)
     {
-        mg_http_reply(c, 400, "", "");
+        mg_http_reply(c, 400, "", "write: %d", errno);
+        us->sid = -1;
+        us->replied = 1;
+        c->is_draining = 1;
+    }
+
+    if (!session && !us->replied)
+    {
+        mg_http_reply(c, 501, "", "Wrong SID"); // session expired mid-stream
+        us->sid = -1;
+        us->replied = 1;
+        c->is_draining = 1;
+    }
+
+    us->received += len;
+    mg_iobuf_del(&c->recv, 0, len);
+
+    if (us->received < us->expected)
+    {
+        pthread_mutex_unlock(&session_lock);
         return;
     }
 
-    char buf[64];
-    mg_http_get_var(&hm->query, "sid", buf, sizeof(buf));
+    if (session)
+        mg_http_reply(c, 200, "", "%ld", (long)session->committed);
+    pthread_mutex_unlock(&session_lock);
+
+    Worker *worker = (Worker *)c->mgr->userdata;
+    histogram_observe(worker->metrics.request + ROUTE_UPLOAD, metrics_now_us() - us->start_us);
 
-    if (atoi(buf) == sid_buf.sid)
+    // hand the connection back to the HTTP parser
+    c->pfn = us->pfn;
+    c->fn_data = NULL;
+    free(us);
+
+    if (c->recv.len > 0 && !c->is_draining)
     {
-        mg_http_get_var(&hm->query, "file", buf, sizeof(buf));
-        sid_buf.file_node.file_name = strdup(buf);
-        add_FileNode(sid_buf.file_node);
+        long n = 0;
+        c->pfn(c, MG_EV_READ, &n); // pipelined request behind the body
+    }
+}
 
-        mg_http_reply(c, 200, "", "{%m: %d, %m: %d}\n",
-                      MG_ESC("status"), 1,
-                      MG_ESC("code"), sid_buf.file_node.pwd);
+void upload_stream_begin(struct mg_connection *c, struct mg_http_message *hm)
+{
+    size_t buffered = c->recv.len - (size_t)(hm->body.buf - (char *)c->recv.buf);
+
+    // chunked or unsized bodies go through the buffered router, and so do bodies that are
+    // in already: finishing here would hand the connection back to the parser mid-message
+    if (mg_http_get_header(hm, "Transfer-Encoding") || !mg_http_get_header(hm, "Content-Length") ||
+        hm->body.len == 0 || buffered >= hm->body.len)
+        return;
+
+    uint64_t start_us = metrics_now_us();
+    UploadStream *us = calloc(1, sizeof(UploadStream));
+    if (!us)
+        return;
+
+    // the session is looked up again on every read, it may expire meanwhile
+    pthread_mutex_lock(&session_lock);
+    UploadSession *session = prepare_upload(c, hm, &us->offset);
+    us->sid = session ? session->sid : -1;
+    pthread_mutex_unlock(&session_lock);
 
-        sid_buf.sid = -1;
-        printf("finalize upload file: %s\n", buf);
+    if (!session)
+    {
+        // error reply is queued, discard the body and close
+        us->replied = 1;
+        c->is_draining = 1;
     }
-    else
+
+    us->expected = hm->body.len;
+    us->start_us = start_us;
+    us->pfn = c->pfn;
+    c->pfn = NULL;
+    c->fn_data = us;
+
+    // drop the headers, and everything the parser already consumed before them
+    mg_iobuf_del(&c->recv, 0, (size_t)(hm->body.buf - (char *)c->recv.buf));
+    upload_stream_read(c);
+}
+
+/*
+ * route table, compiled into route_trie by init_routes
+ * a request that matches no route goes to the static files
+ *
+ */
+enum
+{
+    METHOD_GET = 1,
+    METHOD_HEAD = 2,
+    METHOD_POST = 4,
+};
+
+typedef struct Route
+{
+    const char *path;
+    int is_prefix;    // also matches every uri starting with path
+    unsigned methods; // METHOD_* bits it answers
+    RouterFn fn;
+    void (*begin)(struct mg_connection *c, struct mg_http_message *hm); // called with the headers, may take the body over
+    int metric;                                                         // request histogram, see Metrics
+} Route;
+
+static const Route routes[] = {
+    {"/api/config", 0, METHOD_GET, router_config, NULL, ROUTE_OTHER},
+    {"/api/apply", 0, METHOD_GET, router_apply, NULL, ROUTE_APPLY},
+    {"/api/upload", 0, METHOD_POST, router_upload, upload_stream_begin, ROUTE_UPLOAD},
+    {"/api/upload/status", 0, METHOD_GET, router_upload_status, NULL, ROUTE_OTHER},
+    {"/api/finalizer", 1, METHOD_GET, router_finalizer, NULL, ROUTE_FINALIZER},
+    {"/api/download", 0, METHOD_GET | METHOD_HEAD, router_download, NULL, ROUTE_DOWNLOAD},
+    {"/api/cache", 0, METHOD_GET, router_cache, NULL, ROUTE_OTHER},
+    {"/api/metrics", 0, METHOD_GET, router_metrics, NULL, ROUTE_OTHER},
+    {"/api/status", 0, METHOD_GET, router_status, NULL, ROUTE_OTHER},
+};
+
+int init_routes()
+{
+    if (!(route_trie = createTrie()))
+        return 1;
+
+    for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); ++i)
     {
-        mg_http_reply(c, 501, "", "{%m: %d, %m: %m}\n",
-                      MG_ESC("status"), 0,
-                      MG_ESC("code"), MG_ESC("Wrong Sid"));
+        if (trie_insert(route_trie, routes[i].path, strlen(routes[i].path), routes[i].is_prefix, (int)i) != 0)
+        {
+            fprintf(stderr, "Failed to register route %s\n", routes[i].path);
+            return 1;
+        }
     }
+
+    return trie_compile(route_trie) != 0;
 }
 
-ROUTER(config)
+static unsigned method_bit(struct mg_str method)
 {
-    mg_http_reply(c, 200, "", "{%m: %d, %m: %d}\n",
-                  MG_ESC("file_max_byte"), file_max_byte,
-                  MG_ESC("file_expire"), file_expire);
+    if (mg_strcmp(method, mg_str("GET")) == 0)
+        return METHOD_GET;
+    if (mg_strcmp(method, mg_str("POST")) == 0)
+        return METHOD_POST;
+    if (mg_strcmp(method, mg_str("HEAD")) == 0)
+        return METHOD_HEAD;
+    return 0;
 }
 
-void ws_status_timer_fn(void *data)
+// one pass over the uri, NULL for the static files
+const Route *find_route(struct mg_http_message *hm)
 {
-    int is_busy = sid_buf.sid != -1 || FileNode_num >= file_max_count;
-    char ret[2] = {is_busy + '0', '\0'};
-    mg_ws_send((struct mg_connection *)data, &ret, 1, WEBSOCKET_OP_TEXT);
+    int i = trie_match(route_trie, hm->uri.buf, hm->uri.len);
+    return i < 0 ? NULL : routes + i;
+}
+
+// %M printer for the Allow header of a route
+static size_t print_allow(void (*out)(char, void *), void *arg, va_list *ap)
+{
+    unsigned methods = va_arg(*ap, unsigned);
+    size_t n = 0;
+
+    n += mg_xprintf(out, arg, "%s", methods & METHOD_GET ? "GET" : "");
+    n += mg_xprintf(out, arg, "%s%s", n && (methods & METHOD_HEAD) ? ", " : "", methods & METHOD_HEAD ? "HEAD" : "");
+    n += mg_xprintf(out, arg, "%s%s", n && (methods & METHOD_POST) ? ", " : "", methods & METHOD_POST ? "POST" : "");
+    return n;
 }
 
 void server_fn(struct mg_connection *c, int ev, void *ev_data)
 {
     struct mg_http_message *hm = (struct mg_http_message *)ev_data;
     struct mg_str caps[3]; // router argument buffer
+    Worker *worker = (Worker *)c->mgr->userdata;
 
-    if (ev == MG_EV_HTTP_MSG)
-    {
-        if (mg_match(hm->uri, mg_str("/api/config"), NULL))
-            USE_ROUTER(config);
-
-        else if (mg_match(hm->uri, mg_str("/api/apply"), NULL))
-            USE_ROUTER(apply);
-
-        else if (mg_match(hm->uri, mg_str("/api/upload"), NULL))
-            USE_ROUTER(upload);
-
-        else if (mg_match(hm->uri, mg_str("/api/finalizer#"), NULL))
-            USE_ROUTER(finalizer);
+    // traffic counters, the sendfile path reports its bytes on MG_EV_WRITE too
+    if ((ev == MG_EV_READ || ev == MG_EV_WRITE) && *(long *)ev_data > 0)
+        counter_add(ev == MG_EV_READ ? &worker->metrics.byte_in : &worker->metrics.byte_out, *(long *)ev_data);
+    else if (ev == MG_EV_ACCEPT)
+        counter_add(&worker->metrics.accepted, 1);
+    else if (ev == MG_EV_CLOSE && c->is_accepted)
+        counter_add(&worker->metrics.closed, 1);
 
-        else if (mg_match(hm->uri, mg_str("/api/download"), NULL))
-            USE_ROUTER(download);
-
-        else if (mg_match(hm->uri, mg_str("/api/status"), NULL))
-            mg_ws_upgrade(c, hm, NULL);
+    if (ev == MG_EV_HTTP_HDRS)
+    {
+        const Route *route = find_route(hm);
+        if (route && route->begin && (route->methods & method_bit(hm->method)))
+            route->begin(c, hm);
+    }
+    else if (ev == MG_EV_READ && c->fn_data)
+    {
+        upload_stream_read(c);
+    }
+    else if (ev == MG_EV_HTTP_MSG)
+    {
+        uint64_t start_us = metrics_now_us();
+        const Route *route = find_route(hm);
 
-        else
+        if (!route)
             USE_ROUTER(index_page);
+        else if (route->methods & method_bit(hm->method))
+            route->fn(c, ev, ev_data, hm);
+        else
+        {
+            char allow[64];
+            mg_snprintf(allow, sizeof(allow), "Allow: %M\r\n", print_allow, route->methods);
+            mg_http_reply(c, 405, allow, "");
+        }
+
+        histogram_observe(worker->metrics.request + (route ? route->metric : ROUTE_STATIC), metrics_now_us() - start_us);
     }
     else if (ev == MG_EV_WS_OPEN)
     {
-        struct mg_timer *t = mg_timer_add(&mgr, 1000, MG_TIMER_REPEAT, ws_status_timer_fn, (void *)c);
-        if (hashmap_insert(ws_timer_hashmap, c->id, (void *)t))
-        {
-            // unlucky :(
-            mg_timer_free(&mgr.timers, t);
-        }
+        // catch up first so the newcomer and the others agree on the state
+        broadcast_status(worker);
+        hashmap_insert(worker->subscribers, c->id, (void *)c);
+        send_status(c, worker->busy_sent);
+    }
+    else if (ev == MG_EV_WAKEUP)
+    {
+        broadcast_status(worker);
+    }
+    else if (ev == MG_EV_CLOSE && c->fn_data)
+    {
+        free(c->fn_data); // upload stream dropped before the body completed
+        c->fn_data = NULL;
     }
     else if (ev == MG_EV_CLOSE && c->is_websocket)
     {
-        struct mg_timer *t = hashmap_search(ws_timer_hashmap, c->id);
-        mg_timer_free(&mgr.timers, t);
-        hashmap_delete(ws_timer_hashmap, c->id);
+        hashmap_delete(worker->subscribers, c->id);
+    }
+}
+
+/*
+ * fires every LAG_PROBE_MS, whatever kept the loop busy past the due time shows up as lag
+ * lag_due follows the timer's own schedule, see mg_timer_expired
+ *
+ */
+void lag_probe_timer_fn(void *data)
+{
+    Worker *worker = (Worker *)data;
+    uint64_t now = mg_millis();
+
+    if (worker->lag_due == 0)
+        worker->lag_due = now;
+
+    histogram_observe(&worker->metrics.loop_lag, now > worker->lag_due ? (now - worker->lag_due) * 1000 : 0);
+    worker->lag_due = now - worker->lag_due > LAG_PROBE_MS ? now + LAG_PROBE_MS : worker->lag_due + LAG_PROBE_MS;
+}
+
+/*
+ * event loop of one worker, connection ids and timers are per worker
+ *
+ */
+void *serve_worker(void *data)
+{
+    Worker *worker = (Worker *)data;
+
+    while (!service_should_stop)
+    {
+        mg_mgr_poll(&worker->mgr, 1000); // Infinite event loop
+
+        // expirations are applied by one loop only
+        if (worker == WorkerList)
+            expire_FileNodes();
     }
+
+    return NULL;
 }
 
+// the microbenchmarks include this file, see bench/filebay_microbench.c
+#ifndef FILEBAY_NO_MAIN
 int main(int argc, char **argv)
 {
 
@@ -728,9 +3200,23 @@ int main(int argc, char **argv)
 
     // initialize the FileNode hashmap
     FileNode_hashmap = createHashmap(HASHMAP_SIZE);
+    Blob_hashmap = createHashmap(HASHMAP_SIZE);
+
+    // initialize the download cache
+    if (cache_max_byte > 0)
+        download_cache = createLruCache(cache_max_byte);
+
+    // initialize the expiry index and the queues around the cleaner
+    expiry_heap = createMinHeap(HASHMAP_SIZE);
+    mpsc_init(&schedule_queue);
+    mpsc_init(&expired_queue);
+    mpsc_init(&unlink_queue);
+    sem_init(&cleaner_sem, 0, 0);
+
+    // initialize the upload session table
+    if (init_SessionList())
+        return EXIT_FAILURE;
 
-    // initialize the ws_timer hashmap
-    ws_timer_hashmap = createHashmap(HASHMAP_SIZE);
     // initialize old file node list
     deserialize_FileNodeList();
 
@@ -738,27 +3224,90 @@ int main(int argc, char **argv)
     char server_addr[32];
     sprintf(server_addr, "http://127.0.0.1:%d", atoi(argv[1]));
 
-    mg_mgr_init(&mgr);
+    if (worker_count < 1)
+        worker_count = 1;
 
-    if (!mg_http_listen(&mgr, server_addr, (mg_event_handler_t)server_fn, NULL))
+    mg_rate_init(&send_limit, send_rate, (uint64_t)send_rate * RATE_BURST_MS / 1000);
+    mg_rate_init(&recv_limit, recv_rate, (uint64_t)recv_rate * RATE_BURST_MS / 1000);
+
+    WorkerList = calloc(worker_count, sizeof(Worker));
+    if (!WorkerList)
     {
-        fprintf(stderr, "can't listen on port %d", atoi(argv[1]));
-        return 1;
+        perror("Failed to allocate memory for WorkerList");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < worker_count; ++i)
+    {
+        Worker *worker = WorkerList + i;
+
+        mg_mgr_init(&worker->mgr);
+        if (io_uring && !mg_io_uring_init(&worker->mgr))
+            fprintf(stderr, "WARNING: io_uring unavailable, worker %d stays on epoll\n", i);
+        worker->mgr.userdata = worker;
+        worker->mgr.reuseport = worker_count > 1;
+        worker->mgr.send_limit = &send_limit;
+        worker->mgr.recv_limit = &recv_limit;
+        mg_rate_init(&worker->mgr.conn_send_limit, conn_send_rate, (uint64_t)conn_send_rate * RATE_BURST_MS / 1000);
+        mg_rate_init(&worker->mgr.conn_recv_limit, conn_recv_rate, (uint64_t)conn_recv_rate * RATE_BURST_MS / 1000);
+        worker->subscribers = createHashmap(HASHMAP_SIZE);
+        mg_timer_add(&worker->mgr, LAG_PROBE_MS, MG_TIMER_REPEAT, lag_probe_timer_fn, worker);
+
+        struct mg_connection *listener = mg_http_listen(&worker->mgr, server_addr, (mg_event_handler_t)server_fn, NULL);
+        if (!listener || !mg_wakeup_init(&worker->mgr))
+        {
+            fprintf(stderr, "can't listen on port %d", atoi(argv[1]));
+            return 1;
+        }
+        worker->listener_id = listener->id;
     }
 
+    if (init_routes())
+        return EXIT_FAILURE;
+
+    // state restored sessions and nodes leave us in, the subscribers start from it
+    pthread_mutex_lock(&session_lock);
+    update_service_status();
+    pthread_mutex_unlock(&session_lock);
+    for (int i = 0; i < worker_count; ++i)
+        WorkerList[i].busy_sent = atomic_load(&service_busy);
+
+    // the session table is shared, one sweeper is enough
+    mg_timer_add(&WorkerList[0].mgr, SESSION_SWEEP_MS, MG_TIMER_REPEAT, session_sweep_timer_fn, NULL);
+
     // Create the worker thread
     if (pthread_create(&tid, NULL, cleaner_worker, NULL) != 0)
     {
         perror("Error creating thread\n");
         return EXIT_FAILURE;
     }
-    pthread_detach(tid);
 
-    printf("Server start at %s\n", server_addr);
+    // Create the journal thread
+    if (pthread_create(&journal_tid, NULL, journal_worker, NULL) != 0)
+    {
+        perror("Error creating thread\n");
+        return EXIT_FAILURE;
+    }
+    pthread_detach(journal_tid);
 
-    while (!service_should_stop)
-        mg_mgr_poll(&mgr, 1000); // Infinite event loop
+    // Create the serving threads, the main thread runs the first worker itself
+    for (int i = 1; i < worker_count; ++i)
+    {
+        if (pthread_create(&WorkerList[i].tid, NULL, serve_worker, WorkerList + i) != 0)
+        {
+            perror("Error creating thread\n");
+            return EXIT_FAILURE;
+        }
+    }
 
-    terminate_handler(-1);
+    printf("Server start at %s with %d workers\n", server_addr, worker_count);
+
+    serve_worker(WorkerList);
+
+    for (int i = 1; i < worker_count; ++i)
+        pthread_join(WorkerList[i].tid, NULL);
+
+    cleanup();
     return 0;
 }
+#endif
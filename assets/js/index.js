@@ -146,61 +146,189 @@ function showUploadFailed(msg) {
     }
 }
 
-function sendFileData(name, data, chunkSize) {
+// chunk size bounds and the time one chunk should take, see sendFileData
+const UPLOAD_MIN_CHUNK = 256 * 1024;
+const UPLOAD_MAX_CHUNK = 16 * 1024 * 1024;
+const UPLOAD_CHUNK_MS = 1000;
+
+/*
+    upload a File (or any Blob) in chunks
+
+    chunks are cut from the file with slice() when they are sent, so only the
+    chunks on the wire are held in memory. Up to opts.window chunk POSTs are
+    in flight at once, every ack from the server frees a slot for the next
+    chunk, and the chunk size follows the measured throughput so that one
+    chunk takes about UPLOAD_CHUNK_MS.
+*/
+function sendFileData(name, file, opts) {
+    opts = opts || {};
+    var chunkSize = opts.chunkSize || 2000000;
+    var windowSize = opts.window || 4;
+
     var sid;
+    var retries = 0;
+    var ranges = [];     // acked ranges, sorted and disjoint
+    var pending = [];    // ranges on the wire
+    var next = 0;        // where the next chunk is cut
+    var inflight = 0;
+    var recovering = false;
+    var stopped = false;
+    var resumeKey = 'filebay-upload:' + name + ':' + file.size + ':' + file.lastModified;
 
-    // Step 1: Request /api/apply to get sid
-    fetch('/api/apply')
-        .then(res => res.json())
-        .then(response => {
-            if (response.status == 1) {
-                sid = response.code;
-                sendChunk(0);
+    // ranges the server already holds, null if the session is gone
+    var queryStatus = function (id) {
+        return fetch('/api/upload/status?sid=' + id)
+            .then(res => res.ok ? res.json() : null)
+            .then(response => response && response.status == 1 ? response.ranges : null)
+            .catch(() => null);
+    };
+
+    var addRange = function (start, end) {
+        var merged = [];
+        for (const r of ranges) {
+            if (r[1] < start || r[0] > end) {
+                merged.push(r);
             } else {
-                showUploadFailed(response.code);
+                start = Math.min(start, r[0]);
+                end = Math.max(end, r[1]);
             }
-        })
-        .catch(error => {
-            showUploadFailed(error.code);
-        });
+        }
+        merged.push([start, end]);
+        ranges = merged.sort((x, y) => x[0] - y[0]);
+    };
 
-    // Function to send a chunk
-    var sendChunk = function (offset) {
-        var chunk = data.subarray(offset, offset + chunkSize) || '';
-        var url = '/api/upload?offset=' + offset + '&sid=' + sid;
+    // acked or in flight, neither needs to be sent (again)
+    var covered = function () {
+        return ranges.concat(pending).sort((x, y) => x[0] - y[0]);
+    };
 
-        var opts = {
-            method: 'POST',
-            body: chunk
-        };
+    // first byte at or after offset nobody has sent yet
+    var nextMissing = function (offset) {
+        for (const [start, end] of covered()) {
+            if (start <= offset && offset < end) offset = end;
+        }
+        return offset;
+    };
 
-        fetch(url, opts)
-            .then(async function (res) {
-                const response = await res.json();
-                return ({ ok: res.ok, response });
-            })
-            .then(({ ok, response }) => {
-                if (!ok) {
-                    showUploadFailed(response);
+    // stop a chunk where the server's data starts again
+    var chunkEnd = function (offset) {
+        var end = Math.min(offset + chunkSize, file.size);
+        for (const [start] of covered()) {
+            if (start > offset && start < end) end = start;
+        }
+        return end;
+    };
+
+    // aim for UPLOAD_CHUNK_MS per chunk; the chunks in flight share the link
+    var adapt = function (bytes, ms) {
+        if (bytes < UPLOAD_MIN_CHUNK || ms <= 0) return;
+        var target = bytes / ms * UPLOAD_CHUNK_MS;
+        chunkSize = Math.round((chunkSize + target) / 2);
+        chunkSize = Math.min(UPLOAD_MAX_CHUNK, Math.max(UPLOAD_MIN_CHUNK, chunkSize));
+    };
+
+    var fail = function (msg) {
+        if (stopped) return;
+        stopped = true;
+        showUploadFailed(msg);
+    };
+
+    // fill the window, finalize once every byte is acked
+    var pump = function () {
+        if (stopped || recovering) return;
+
+        while (inflight < windowSize) {
+            var offset = nextMissing(next);
+            if (offset >= file.size) break;
+            next = chunkEnd(offset);
+            sendChunk(offset, next);
+        }
+
+        if (inflight == 0 && nextMissing(0) >= file.size) {
+            stopped = true;
+            finalizeUpload(name);
+        }
+    };
+
+    // after a dropped request, ask the server what arrived and send only the rest
+    var resume = function () {
+        if (recovering || stopped) return;
+        if (++retries > 5) {
+            fail('Connection lost');
+            return;
+        }
+
+        recovering = true;
+        setTimeout(() => {
+            queryStatus(sid).then(received => {
+                recovering = false;
+                if (received) {
+                    for (const [start, end] of received) addRange(start, end);
+                    next = 0;
+                    pump();
                 } else {
-                    if (chunk.length > 0 && offset + chunk.length < data.length) {
-                        sendChunk(offset + chunk.length);
-                    } else if (offset + chunk.length >= data.length) {
-                        finalizeUpload(name);
-                    }
+                    localStorage.removeItem(resumeKey);
+                    fail('Upload session expired');
                 }
-            })
-            .catch(error => {
-                showUploadFailed(error);
+            });
+        }, 1000 * retries);
+    };
+
+    // what the server said about a failed request, JSON replies carry it in code
+    var httpError = function (res, body) {
+        var msg = 'HTTP ' + res.status + (res.statusText ? ' ' + res.statusText : '');
+        var type = res.headers.get('Content-Type') || '';
+
+        // an error page from a proxy in front of the server says nothing more
+        if (type.includes('html') || !body.trim()) return msg;
+        try {
+            var reply = JSON.parse(body);
+            if (reply && reply.code) return msg + ': ' + reply.code;
+        } catch (e) { }
+        return msg + ': ' + body.trim();
+    };
+
+    // Function to send a chunk, the body is read from the file by the browser
+    var sendChunk = function (start, end) {
+        var url = '/api/upload?offset=' + start + '&sid=' + sid;
+        var begin = performance.now();
+
+        var range = [start, end];
+        var done = function () {
+            inflight--;
+            pending.splice(pending.indexOf(range), 1);
+        };
+
+        inflight++;
+        pending.push(range);
+        fetch(url, { method: 'POST', body: file.slice(start, end) })
+            .then(res => res.text().then(body => ({ res, body })))
+            .then(({ res, body }) => {
+                done();
+                if (!res.ok) {
+                    localStorage.removeItem(resumeKey);
+                    fail(httpError(res, body));
+                    return;
+                }
+
+                retries = 0;
+                addRange(start, end);
+                adapt(end - start, performance.now() - begin);
+                pump();
+            }, () => {
+                // the request or its reply got lost, the server may still have the chunk
+                done();
+                resume();
             });
     };
 
     // Step 3: Finalize upload
     var finalizeUpload = function (filename) {
-        fetch('/api/finalizer?sid=' + sid + '&file=' + filename)
+        fetch('/api/finalizer?sid=' + sid + '&file=' + filename + '&size=' + file.size)
             .then(res => res.json())
             .then(response => {
                 if (response.status == 1) {
+                    localStorage.removeItem(resumeKey);
                     showUploadSuccess(response.code);
                 } else {
                     showUploadFailed(response.code);
@@ -210,4 +338,39 @@ function sendFileData(name, data, chunkSize) {
                 showUploadFailed(error.message);
             });
     };
+
+    // Step 1: Request /api/apply to get sid, unless the server still holds this file's session
+    var apply = function () {
+        fetch('/api/apply')
+            .then(res => res.json())
+            .then(response => {
+                if (response.status == 1) {
+                    sid = response.code;
+                    localStorage.setItem(resumeKey, sid);
+                    // an empty file still needs one chunk to open its staging file
+                    if (file.size == 0) sendChunk(0, 0);
+                    else pump();
+                } else {
+                    showUploadFailed(response.code);
+                }
+            })
+            .catch(error => {
+                showUploadFailed(error.code);
+            });
+    };
+
+    var resumed = localStorage.getItem(resumeKey);
+    if (resumed) {
+        queryStatus(resumed).then(received => {
+            if (received) {
+                sid = resumed;
+                for (const [start, end] of received) addRange(start, end);
+                pump();
+            } else {
+                apply();
+            }
+        });
+    } else {
+        apply();
+    }
 }
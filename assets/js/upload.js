@@ -13,11 +13,8 @@ var dropZone = document.getElementById('drop_zone_container');
 
 function upload_handler(formData) {
 
-    var f = formData.get('file'), r = new FileReader();
-    r.readAsArrayBuffer(f);
-    r.onload = async function () {
-        sendFileData(f.name, new Uint8Array(r.result), 2000000, 114514);
-    }
+    var f = formData.get('file');
+    sendFileData(f.name, f, { chunkSize: 2000000, window: 4 });
 }
 
 dropZone.addEventListener('dragover', function (e) {
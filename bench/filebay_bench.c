@@ -0,0 +1,493 @@
+/*
+ * end-to-end benchmark: drives apply -> upload -> finalizer -> download
+ * against a running server through mongoose's HTTP client, and prints the
+ * results as JSON so runs can be diffed
+ *
+ * every client keeps one keep-alive connection and runs whole cycles back
+ * to back. Uploads go in chunks like upload.js, each one starts with a
+ * unique prefix so the dedup store is not all that gets measured. Finalized
+ * files stay until they expire, so run the server with file_max_count well
+ * above the number of cycles and session_max_count above the concurrency,
+ * refused requests show up as errors.
+ *
+ * sizes are a fixed size, or MIN-MAX for sizes spread evenly on a log
+ * scale, k, m and g suffixes are powers of 1024
+ *
+ * gcc bench/filebay_bench.c mongoose.c -Iinclude -O3 -lm -o filebay_bench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "mongoose.h"
+
+#define REQUEST_TIMEOUT_MS 10000
+#define RETRY_MS 100 // pause after a failed request
+#define POLL_MS 10
+#define PREFIX_LEN 24
+
+enum
+{
+    STEP_APPLY,
+    STEP_UPLOAD,
+    STEP_FINALIZER,
+    STEP_DOWNLOAD,
+    STEP_CYCLE, // whole apply to download round, only a latency
+    STEP_NUM,
+    STEP_IDLE = STEP_NUM,
+};
+
+static const char *step_names[STEP_NUM] = {"apply", "upload", "finalizer", "download", "cycle"};
+
+typedef struct
+{
+    uint32_t *us;
+    size_t len, max;
+} Samples;
+
+typedef struct Client
+{
+    int id;
+    struct mg_connection *c;
+    int step;
+    uint64_t cycle;
+    size_t size; // file being uploaded
+    size_t sent; // bytes acknowledged by the server
+    size_t chunk;
+    long sid, code;
+    uint64_t cycle_us, request_us; // start times
+    uint64_t timeout_ms, retry_ms;
+    mg_event_handler_t pfn; // HTTP handler, put aside while a download is drained
+    size_t body_left;
+} Client;
+
+// options
+static const char *url = "http://127.0.0.1:8080";
+static int concurrency = 4, duration = 10;
+static size_t size_min = 65536, size_max = 65536, chunk_size = 2000000;
+static uint64_t seed = 1;
+
+static struct mg_str host;
+static char *payload;
+static int running = 1;
+
+static Samples latency[STEP_NUM];
+static uint64_t errors[STEP_NUM], connect_errors;
+static uint64_t requests, byte_up, byte_down;
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// xorshift64, the same seed gives the same size sequence
+static uint64_t next_rand()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static size_t pick_size()
+{
+    if (size_min == size_max)
+        return size_min;
+
+    double u = (double)(next_rand() >> 11) / (double)(1ULL << 53);
+    return (size_t)exp(log((double)size_min) + u * (log((double)size_max) - log((double)size_min)));
+}
+
+static size_t parse_size(const char *str)
+{
+    char *end;
+    double n = strtod(str, &end);
+
+    if (*end == 'k' || *end == 'K')
+        n *= 1024;
+    else if (*end == 'm' || *end == 'M')
+        n *= 1024 * 1024;
+    else if (*end == 'g' || *end == 'G')
+        n *= 1024 * 1024 * 1024;
+    return n < 1 ? 1 : (size_t)n;
+}
+
+static void add_sample(int step, uint64_t us)
+{
+    Samples *s = latency + step;
+
+    if (s->len == s->max)
+    {
+        size_t max = s->max ? s->max * 2 : 1024;
+        uint32_t *temp = realloc(s->us, sizeof(uint32_t) * max);
+        if (!temp)
+            return;
+        s->us = temp;
+        s->max = max;
+    }
+    s->us[s->len++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+/*
+ * protocol steps, one request in flight per client
+ *
+ */
+static void begin_request(Client *cl, int step)
+{
+    cl->step = step;
+    cl->request_us = now_us();
+    cl->timeout_ms = mg_millis() + REQUEST_TIMEOUT_MS;
+}
+
+static void end_request(Client *cl)
+{
+    requests++;
+    add_sample(cl->step, now_us() - cl->request_us);
+}
+
+// count the failure, drop the connection and try again a little later
+static void fail(Client *cl)
+{
+    if (cl->step < STEP_NUM)
+        errors[cl->step]++;
+    cl->step = STEP_IDLE;
+    cl->retry_ms = mg_millis() + RETRY_MS;
+    if (cl->c)
+        cl->c->is_draining = 1;
+}
+
+static void send_apply(Client *cl)
+{
+    cl->cycle_us = now_us();
+    cl->size = pick_size();
+    cl->sent = 0;
+    begin_request(cl, STEP_APPLY);
+    mg_printf(cl->c, "GET /api/apply HTTP/1.1\r\nHost: %.*s\r\n\r\n", (int)host.len, host.buf);
+}
+
+static void send_chunk(Client *cl)
+{
+    char prefix[PREFIX_LEN + 1];
+
+    cl->chunk = cl->size - cl->sent < chunk_size ? cl->size - cl->sent : chunk_size;
+    begin_request(cl, STEP_UPLOAD);
+    mg_printf(cl->c, "POST /api/upload?sid=%ld&offset=%lu HTTP/1.1\r\nHost: %.*s\r\nContent-Length: %lu\r\n\r\n",
+              cl->sid, (unsigned long)cl->sent, (int)host.len, host.buf, (unsigned long)cl->chunk);
+
+    if (cl->sent > 0)
+    {
+        mg_send(cl->c, payload + cl->sent, cl->chunk);
+        return;
+    }
+
+    // mg_send copies, so the shared payload can carry this upload's prefix meanwhile
+    snprintf(prefix, sizeof(prefix), "%08d:%015llu", cl->id, (unsigned long long)cl->cycle);
+    memcpy(payload, prefix, cl->chunk < PREFIX_LEN ? cl->chunk : PREFIX_LEN);
+    mg_send(cl->c, payload, cl->chunk);
+}
+
+static void send_finalizer(Client *cl)
+{
+    begin_request(cl, STEP_FINALIZER);
+    mg_printf(cl->c, "GET /api/finalizer?sid=%ld&file=bench.bin&size=%lu HTTP/1.1\r\nHost: %.*s\r\n\r\n",
+              cl->sid, (unsigned long)cl->size, (int)host.len, host.buf);
+}
+
+static void send_download(Client *cl)
+{
+    begin_request(cl, STEP_DOWNLOAD);
+    mg_printf(cl->c, "GET /api/download?pass=%ld HTTP/1.1\r\nHost: %.*s\r\n\r\n",
+              cl->code, (int)host.len, host.buf);
+}
+
+static void end_cycle(Client *cl)
+{
+    byte_down += cl->size;
+    add_sample(STEP_CYCLE, now_us() - cl->cycle_us);
+    cl->cycle++;
+    send_apply(cl);
+}
+
+/*
+ * take the download body over from the HTTP parser once the headers are in,
+ * and drop it as it comes, a download may be larger than MG_MAX_RECV_SIZE
+ *
+ */
+static void download_read(Client *cl)
+{
+    struct mg_connection *c = cl->c;
+    size_t len = c->recv.len < cl->body_left ? c->recv.len : cl->body_left;
+    mg_iobuf_del(&c->recv, 0, len);
+    cl->body_left -= len;
+    if (cl->body_left > 0)
+        return;
+
+    c->pfn = cl->pfn;
+    end_request(cl);
+    end_cycle(cl);
+}
+
+static void download_begin(Client *cl, struct mg_http_message *hm)
+{
+    struct mg_connection *c = cl->c;
+    size_t buffered = c->recv.len - (size_t)(hm->body.buf - (char *)c->recv.buf);
+
+    // errors and bodies that are in already go to on_response, finishing here would
+    // hand the connection back to the parser mid-message. body.len is the Content-Length
+    if (mg_http_status(hm) != 200 || buffered >= hm->body.len)
+        return;
+
+    if (!mg_http_get_header(hm, "Content-Length") || hm->body.len != cl->size)
+    {
+        fail(cl);
+        return;
+    }
+
+    cl->body_left = cl->size;
+    cl->pfn = c->pfn;
+    c->pfn = NULL;
+    mg_iobuf_del(&c->recv, 0, (size_t)(hm->body.buf - (char *)c->recv.buf));
+    download_read(cl);
+}
+
+static void on_response(Client *cl, struct mg_http_message *hm)
+{
+    if (cl->step == STEP_IDLE)
+        return;
+
+    if (mg_http_status(hm) != 200)
+    {
+        fail(cl);
+        return;
+    }
+
+    end_request(cl);
+
+    switch (cl->step)
+    {
+    case STEP_APPLY:
+        if ((cl->sid = mg_json_get_long(hm->body, "$.code", -1)) < 0)
+            fail(cl);
+        else
+            send_chunk(cl);
+        break;
+
+    case STEP_UPLOAD:
+        cl->sent += cl->chunk;
+        byte_up += cl->chunk;
+        if (cl->sent < cl->size)
+            send_chunk(cl);
+        else
+            send_finalizer(cl);
+        break;
+
+    case STEP_FINALIZER:
+        if ((cl->code = mg_json_get_long(hm->body, "$.code", -1)) < 0)
+            fail(cl);
+        else
+            send_download(cl);
+        break;
+
+    case STEP_DOWNLOAD:
+        if (hm->body.len != cl->size)
+            fail(cl);
+        else
+            end_cycle(cl);
+        break;
+    }
+}
+
+static void client_fn(struct mg_connection *c, int ev, void *ev_data)
+{
+    Client *cl = (Client *)c->fn_data;
+
+    if (ev == MG_EV_CONNECT)
+    {
+        send_apply(cl);
+    }
+    else if (ev == MG_EV_HTTP_HDRS && cl->step == STEP_DOWNLOAD)
+    {
+        download_begin(cl, (struct mg_http_message *)ev_data);
+    }
+    else if (ev == MG_EV_READ && cl->step == STEP_DOWNLOAD && c->pfn == NULL)
+    {
+        download_read(cl);
+    }
+    else if (ev == MG_EV_HTTP_MSG)
+    {
+        on_response(cl, (struct mg_http_message *)ev_data);
+    }
+    else if (ev == MG_EV_POLL && running)
+    {
+        uint64_t now = *(uint64_t *)ev_data;
+        if (cl->step != STEP_IDLE && now > cl->timeout_ms)
+            fail(cl);
+    }
+    else if (ev == MG_EV_CLOSE)
+    {
+        if (running && c->is_connecting)
+        {
+            connect_errors++;
+            cl->retry_ms = mg_millis() + RETRY_MS;
+        }
+        else if (running && cl->step != STEP_IDLE)
+            fail(cl);
+        cl->c = NULL;
+    }
+}
+
+/*
+ * report
+ *
+ */
+static int compare_us(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(Samples *s, double q)
+{
+    if (s->len == 0)
+        return 0;
+
+    size_t i = (size_t)(q * s->len);
+    return s->us[i < s->len ? i : s->len - 1] / 1000.0;
+}
+
+static void report(double seconds)
+{
+    printf("{\n  \"url\": \"%s\",\n  \"concurrency\": %d,\n  \"duration_s\": %.3f,\n", url, concurrency, seconds);
+    printf("  \"size_min\": %lu,\n  \"size_max\": %lu,\n  \"chunk_size\": %lu,\n",
+           (unsigned long)size_min, (unsigned long)size_max, (unsigned long)chunk_size);
+    printf("  \"cycles\": %lu,\n  \"requests\": %llu,\n  \"requests_per_sec\": %.1f,\n",
+           (unsigned long)latency[STEP_CYCLE].len, (unsigned long long)requests, requests / seconds);
+    printf("  \"upload_mb_per_sec\": %.2f,\n  \"download_mb_per_sec\": %.2f,\n",
+           byte_up / seconds / 1e6, byte_down / seconds / 1e6);
+
+    printf("  \"errors\": {\"connect\": %llu", (unsigned long long)connect_errors);
+    for (int step = 0; step < STEP_CYCLE; ++step)
+        printf(", \"%s\": %llu", step_names[step], (unsigned long long)errors[step]);
+    printf("},\n  \"latency_ms\": {\n");
+
+    for (int step = 0; step < STEP_NUM; ++step)
+    {
+        Samples *s = latency + step;
+        qsort(s->us, s->len, sizeof(uint32_t), compare_us);
+        printf("    \"%s\": {\"count\": %lu, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}%s\n",
+               step_names[step], (unsigned long)s->len, percentile_ms(s, 0.5), percentile_ms(s, 0.99),
+               percentile_ms(s, 0.999), percentile_ms(s, 1), step + 1 < STEP_NUM ? "," : "");
+    }
+    printf("  }\n}\n");
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "%s [-u URL] [-c CONCURRENCY] [-d SECONDS] [-s SIZE|MIN-MAX] [-k CHUNK] [-r SEED]\n"
+            "  defaults: -u %s -c %d -d %d -s 64k -k %lu -r 1\n",
+            name, url, concurrency, duration, (unsigned long)chunk_size);
+}
+
+int main(int argc, char **argv)
+{
+    struct mg_mgr mgr;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:c:d:s:k:r:h")) != -1)
+    {
+        char *dash;
+        switch (opt)
+        {
+        case 'u':
+            url = optarg;
+            break;
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 's':
+            size_min = size_max = parse_size(optarg);
+            if ((dash = strchr(optarg, '-')))
+                size_max = parse_size(dash + 1);
+            break;
+        case 'k':
+            chunk_size = parse_size(optarg);
+            break;
+        case 'r':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (concurrency < 1 || duration < 1 || size_min > size_max || seed == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // random content, so the server hashes and stores real data
+    if (!(payload = malloc(size_max)))
+    {
+        perror("Failed to allocate the payload");
+        return 1;
+    }
+    for (size_t i = 0; i < size_max; i += sizeof(uint64_t))
+    {
+        uint64_t r = next_rand();
+        memcpy(payload + i, &r, size_max - i < sizeof(r) ? size_max - i : sizeof(r));
+    }
+
+    Client *clients = calloc(concurrency, sizeof(Client));
+    if (!clients)
+    {
+        perror("Failed to allocate the clients");
+        return 1;
+    }
+
+    mg_log_set(MG_LL_NONE);
+    mg_mgr_init(&mgr);
+    host = mg_url_host(url);
+
+    uint64_t start = now_us(), end = start + (uint64_t)duration * 1000000;
+    for (int i = 0; i < concurrency; ++i)
+    {
+        clients[i].id = i;
+        clients[i].step = STEP_IDLE;
+    }
+
+    while (now_us() < end)
+    {
+        uint64_t now = mg_millis();
+        for (int i = 0; i < concurrency; ++i)
+        {
+            Client *cl = clients + i;
+            if (cl->c == NULL && now >= cl->retry_ms && (cl->c = mg_http_connect(&mgr, url, client_fn, cl)))
+                cl->c->is_ticking = 1; // timeouts are checked on MG_EV_POLL
+            else if (cl->c && cl->step == STEP_IDLE && !cl->c->is_connecting && !cl->c->is_draining &&
+                     now >= cl->retry_ms)
+                send_apply(cl);
+        }
+        mg_mgr_poll(&mgr, POLL_MS);
+    }
+
+    // whatever is still in flight does not count
+    running = 0;
+    report((now_us() - start) / 1e6);
+
+    mg_mgr_free(&mgr);
+    for (int step = 0; step < STEP_NUM; ++step)
+        free(latency[step].us);
+    free(clients);
+    free(payload);
+    return 0;
+}
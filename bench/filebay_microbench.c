@@ -0,0 +1,432 @@
+/*
+ * microbenchmarks for the code on every request: pickup code lookups, HTTP
+ * parsing, query extraction, route matching against the old mg_match chain,
+ * and the snapshot at 10k and 1M nodes
+ *
+ * FileBay.c is compiled in, so the real functions are measured on the real
+ * data structures. Each row is calibrated to ROUND_NS a round, then run for
+ * ROUNDS rounds (ROUNDS_SLOW for the snapshot), and the spread of the per
+ * round ns/op is reported: rsd is the standard deviation relative to the
+ * mean, compare medians only when it is small. The snapshot rows include
+ * the fsync of the dump, and use a scratch directory under /tmp.
+ *
+ * gcc bench/filebay_microbench.c mongoose.c -Iinclude -O3 -pthread -lm -o filebay_microbench
+ */
+#define FILEBAY_NO_MAIN
+
+#include "../FileBay.c"
+
+#include <math.h>
+
+#define ROUND_NS 20e6
+#define ROUNDS 15
+#define ROUNDS_SLOW 5
+#define LOOKUP_NUM 65536 // keys looked up in turn, random over the live nodes
+
+typedef double (*BenchFn)(size_t iters); // returns ns spent on iters operations
+
+static FILE *report;
+static char scratch_dir[32];
+static volatile uintptr_t sink; // keeps results alive
+
+// requests as a browser sends them through index.js
+static const char upload_request[] =
+    "POST /api/upload?sid=381924&offset=4000000 HTTP/1.1\r\n"
+    "Host: filebay.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Length: 2000000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/126.0.0.0 Safari/537.36\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "Accept: */*\r\n"
+    "Origin: https://filebay.example.com\r\n"
+    "Referer: https://filebay.example.com/\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "\r\n";
+
+static const char download_request[] =
+    "GET /api/download?pass=472529 HTTP/1.1\r\n"
+    "Host: filebay.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/126.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Referer: https://filebay.example.com/\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "\r\n";
+
+// the mg_match chain server_fn used before the route table, in its order
+static const char *route_patterns[] = {"/api/config", "/api/apply", "/api/upload", "/api/upload/status",
+                                       "/api/finalizer#", "/api/download", "/api/cache", "/api/metrics",
+                                       "/api/status", NULL};
+
+static const char *route_uris[] = {"/api/apply", "/api/upload", "/api/finalizer", "/api/download",
+                                   "/assets/index.js", "/", NULL};
+
+static unsigned int lookup_keys[LOOKUP_NUM];
+static unsigned int *insert_keys;
+static int node_num;
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * FileBay state
+ *
+ */
+static void reset_state()
+{
+    MpscNode *link;
+
+    freeFileNodeList();
+    if (snapshot_map)
+        munmap(snapshot_map, snapshot_len);
+    snapshot_map = NULL;
+    snapshot_len = 0;
+
+    // deadlines nobody is going to pick up
+    expiry_heap->count = 0;
+    while ((link = mpsc_pop(&schedule_queue)))
+        free(mpsc_entry(link, ExpiryMsg, link));
+    sem_destroy(&cleaner_sem);
+    sem_init(&cleaner_sem, 0, 0);
+
+    freeHashmap(FileNode_hashmap);
+    freeBlobs();
+    FileNode_hashmap = createHashmap(HASHMAP_SIZE);
+    Blob_hashmap = createHashmap(HASHMAP_SIZE);
+    FileNode_next_id = 0;
+    storage_byte = 0;
+}
+
+// n live nodes, every one with content of its own
+static void populate(int n)
+{
+    time_t now = time(NULL);
+
+    reset_state();
+    for (int i = 0; i < n; ++i)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "upload-%d.bin", i);
+
+        FileNode node = {
+            .id = i,
+            .file_name = strdup(name),
+            .file_size = 4096 + i % 65536,
+            .expire_time = now + 3600,
+            .pwd = 100000 + i,
+        };
+        uint64_t mix = (uint64_t)i * 0x9e3779b97f4a7c15ULL;
+        for (size_t k = 0; k < sizeof(node.digest); k += sizeof(mix))
+            memcpy(node.digest + k, &mix, sizeof(mix)), mix = mix * 6364136223846793005ULL + 1;
+
+        if (append_FileNode(node) == 0)
+            ref_Blob(&node);
+        else
+            free(node.file_name);
+    }
+
+    node_num = n;
+    srand(n);
+    for (int i = 0; i < LOOKUP_NUM; ++i)
+        lookup_keys[i] = 100000 + rand() % n;
+
+    free(insert_keys);
+    insert_keys = malloc(sizeof(unsigned int) * n);
+    for (int i = 0; i < n; ++i)
+        insert_keys[i] = 100000 + i;
+    for (int i = n - 1; i > 0; --i)
+    {
+        int j = rand() % (i + 1);
+        unsigned int key = insert_keys[i];
+        insert_keys[i] = insert_keys[j], insert_keys[j] = key;
+    }
+}
+
+// a clean journal of the snapshot's generation, so loading takes the clean start path
+static void mark_clean()
+{
+    journal_fd = open(journal_dist, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    reset_journal(JOURNAL_CLEAN);
+    close(journal_fd);
+    journal_fd = -1;
+}
+
+/*
+ * benchmarks
+ *
+ */
+static double bench_hashmap_search(size_t iters)
+{
+    uintptr_t acc = 0;
+    double t = now_ns();
+    for (size_t i = 0; i < iters; ++i)
+        acc += (uintptr_t)hashmap_search(FileNode_hashmap, lookup_keys[i % LOOKUP_NUM]);
+    t = now_ns() - t;
+    sink = acc;
+    return t;
+}
+
+// fresh tables filled with the live codes in random order, growth included
+static double bench_hashmap_insert(size_t iters)
+{
+    double total = 0;
+    size_t done = 0;
+
+    while (done < iters)
+    {
+        Hashmap *map = createHashmap(HASHMAP_SIZE);
+        size_t n = iters - done < (size_t)node_num ? iters - done : (size_t)node_num;
+
+        double t = now_ns();
+        for (size_t i = 0; i < n; ++i)
+            hashmap_insert(map, insert_keys[i], (void *)map);
+        total += now_ns() - t;
+
+        freeHashmap(map);
+        done += n;
+    }
+    return total;
+}
+
+static double bench_get_FileNode(size_t iters)
+{
+    uintptr_t acc = 0;
+    double t = now_ns();
+    for (size_t i = 0; i < iters; ++i)
+        acc += (uintptr_t)get_FileNode(lookup_keys[i % LOOKUP_NUM]);
+    t = now_ns() - t;
+    sink = acc;
+    return t;
+}
+
+static double parse(const char *request, size_t len, size_t iters)
+{
+    struct mg_http_message hm;
+    uintptr_t acc = 0;
+    double t = now_ns();
+    for (size_t i = 0; i < iters; ++i)
+        acc += mg_http_parse(request, len, &hm) + hm.body.len;
+    t = now_ns() - t;
+    sink = acc;
+    return t;
+}
+
+static double bench_parse_upload(size_t iters)
+{
+    return parse(upload_request, sizeof(upload_request) - 1, iters);
+}
+
+static double bench_parse_download(size_t iters)
+{
+    return parse(download_request, sizeof(download_request) - 1, iters);
+}
+
+// what prepare_upload pulls out of the query
+static double bench_get_var_upload(size_t iters)
+{
+    struct mg_http_message hm;
+    char buf[32];
+    uintptr_t acc = 0;
+
+    mg_http_parse(upload_request, sizeof(upload_request) - 1, &hm);
+    double t = now_ns();
+    for (size_t i = 0; i < iters; ++i)
+    {
+        acc += mg_http_get_var(&hm.query, "sid", buf, sizeof(buf));
+        acc += mg_http_get_var(&hm.query, "offset", buf, sizeof(buf));
+    }
+    t = now_ns() - t;
+    sink = acc;
+    return t;
+}
+
+static double bench_get_var_download(size_t iters)
+{
+    struct mg_http_message hm;
+    char buf[32];
+    uintptr_t acc = 0;
+
+    mg_http_parse(download_request, sizeof(download_request) - 1, &hm);
+    double t = now_ns();
+    for (size_t i = 0; i < iters; ++i)
+        acc += mg_http_get_var(&hm.query, "pass", buf, sizeof(buf));
+    t = now_ns() - t;
+    sink = acc;
+    return t;
+}
+
+// one dispatch per operation, the uris take turns
+static double bench_route_chain(size_t iters)
+{
+    struct mg_str uris[sizeof(route_uris) / sizeof(route_uris[0])];
+    size_t uri_num = 0;
+    uintptr_t acc = 0;
+
+    while (route_uris[uri_num])
+        uris[uri_num] = mg_str(route_uris[uri_num]), uri_num++;
+
+    double t = now_ns();
+    for (size_t i = 0; i < iters; ++i)
+    {
+        struct mg_str uri = uris[i % uri_num];
+        int route = 0;
+        while (route_patterns[route] && !mg_match(uri, mg_str(route_patterns[route]), NULL))
+            route++;
+        acc += route;
+    }
+    t = now_ns() - t;
+    sink = acc;
+    return t;
+}
+
+static double bench_find_route(size_t iters)
+{
+    struct mg_http_message hm[sizeof(route_uris) / sizeof(route_uris[0])];
+    size_t uri_num = 0;
+    uintptr_t acc = 0;
+
+    while (route_uris[uri_num])
+        hm[uri_num].uri = mg_str(route_uris[uri_num]), uri_num++;
+
+    double t = now_ns();
+    for (size_t i = 0; i < iters; ++i)
+        acc += (uintptr_t)find_route(hm + i % uri_num);
+    t = now_ns() - t;
+    sink = acc;
+    return t;
+}
+
+static double bench_serialize(size_t iters)
+{
+    double t = now_ns();
+    for (size_t i = 0; i < iters; ++i)
+        serialize_FileNodeList();
+    return now_ns() - t;
+}
+
+// load the snapshot serialize left behind, from scratch every time
+static double bench_deserialize(size_t iters)
+{
+    double total = 0;
+
+    for (size_t i = 0; i < iters; ++i)
+    {
+        reset_state();
+        mark_clean();
+
+        double t = now_ns();
+        deserialize_FileNodeList();
+        total += now_ns() - t;
+
+        close(journal_fd);
+        journal_fd = -1;
+    }
+    return total;
+}
+
+/*
+ * driver
+ *
+ */
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void run(const char *name, int n, BenchFn fn, int rounds)
+{
+    double samples[ROUNDS], mean = 0, var = 0;
+    size_t iters = 1;
+
+    // grow the batch until a round is long enough to time
+    for (;;)
+    {
+        double ns = fn(iters);
+        if (ns >= ROUND_NS || iters >= ((size_t)1 << 32))
+            break;
+        iters *= ns < ROUND_NS / 8 ? 8 : 2;
+    }
+
+    for (int r = 0; r < rounds; ++r)
+    {
+        samples[r] = fn(iters) / iters;
+        mean += samples[r] / rounds;
+    }
+    for (int r = 0; r < rounds; ++r)
+        var += (samples[r] - mean) * (samples[r] - mean) / (rounds > 1 ? rounds - 1 : 1);
+    qsort(samples, rounds, sizeof(double), compare_double);
+
+    fprintf(report, "%-24s %8d %6d %14.1f %14.1f %14.1f %14.1f %6.1f%%\n", name, n, rounds,
+            samples[rounds / 2], mean, samples[0], samples[rounds - 1], mean > 0 ? sqrt(var) / mean * 100 : 0);
+    fflush(report);
+}
+
+int main()
+{
+    int sizes[] = {10000, 1000000};
+
+    // FileBay reports on stdout, keep it out of the table
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    int devnull = open("/dev/null", O_WRONLY);
+    if (!report || devnull < 0)
+        return 1;
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    strcpy(scratch_dir, "/tmp/fbmb.XXXXXX");
+    if (!mkdtemp(scratch_dir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(storage_dir, sizeof(storage_dir), "%s/files", scratch_dir);
+    snprintf(dump_dist, sizeof(dump_dist), "%s/dump.bin", scratch_dir);
+    snprintf(journal_dist, sizeof(journal_dist), "%s/journal.bin", scratch_dir);
+    mkdir(storage_dir, 0700);
+
+    session_max_count = 1;
+    worker_count = 1;
+    if (init_SessionList() || init_routes())
+        return 1;
+    mpsc_init(&schedule_queue);
+    sem_init(&cleaner_sem, 0, 0);
+    expiry_heap = createMinHeap(HASHMAP_SIZE);
+    FileNode_hashmap = createHashmap(HASHMAP_SIZE);
+    Blob_hashmap = createHashmap(HASHMAP_SIZE);
+
+    fprintf(report, "%-24s %8s %6s %14s %14s %14s %14s %7s\n", "benchmark", "nodes", "rounds",
+            "median ns/op", "mean ns/op", "min ns/op", "max ns/op", "rsd");
+
+    run("mg_http_parse upload", 0, bench_parse_upload, ROUNDS);
+    run("mg_http_parse download", 0, bench_parse_download, ROUNDS);
+    run("mg_http_get_var upload", 0, bench_get_var_upload, ROUNDS);
+    run("mg_http_get_var download", 0, bench_get_var_download, ROUNDS);
+    run("mg_match chain", 0, bench_route_chain, ROUNDS);
+    run("find_route", 0, bench_find_route, ROUNDS);
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        populate(sizes[i]);
+        run("hashmap_insert", sizes[i], bench_hashmap_insert, ROUNDS);
+        run("hashmap_search", sizes[i], bench_hashmap_search, ROUNDS);
+        run("get_FileNode", sizes[i], bench_get_FileNode, ROUNDS);
+        run("serialize_FileNodeList", sizes[i], bench_serialize, ROUNDS_SLOW);
+        run("deserialize_FileNodeList", sizes[i], bench_deserialize, ROUNDS_SLOW);
+    }
+
+    reset_state();
+    free(insert_keys);
+    unlink(dump_dist);
+    unlink(journal_dist);
+    rmdir(storage_dir);
+    rmdir(scratch_dir);
+    return 0;
+}
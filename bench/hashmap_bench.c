@@ -0,0 +1,213 @@
+/*
+ * microbenchmark: robin hood hashmap (include/hashmap.h) against the
+ * previous fixed-size direct-mapped table
+ *
+ * insert times include table growth. The legacy table refuses colliding
+ * keys, which keeps its inserts cheap and is why its found column drops.
+ *
+ * gcc bench/hashmap_bench.c -Iinclude -O3 -o hashmap_bench
+ */
+#define HASHMAP_IMPLEMENTATION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hashmap.h"
+
+#define LEGACY_SIZE 256
+#define ROUNDS 5
+
+/*
+ * the previous table, kept verbatim apart from the names: one slot per
+ * bucket, an insert that lands on a used slot is refused
+ */
+typedef struct
+{
+    unsigned int key;
+    void *value;
+} LegacyEntry;
+
+typedef struct
+{
+    LegacyEntry **entries;
+    int size;
+} Legacy;
+
+static unsigned int legacy_hash(unsigned int key, int size)
+{
+    key = ((key >> 16) ^ key) * 0x45d9f3b;
+    key = ((key >> 16) ^ key) * 0x45d9f3b;
+    key = (key >> 16) ^ key;
+
+    return key % size;
+}
+
+static Legacy *legacy_create(int size)
+{
+    Legacy *map = malloc(sizeof(Legacy));
+    map->size = size;
+    map->entries = calloc(size, sizeof(LegacyEntry *));
+    return map;
+}
+
+static int legacy_insert(Legacy *map, unsigned int key, void *value)
+{
+    int index = legacy_hash(key, map->size);
+
+    if (map->entries[index] != NULL)
+        return 1;
+
+    LegacyEntry *entry = malloc(sizeof(LegacyEntry));
+    entry->key = key;
+    entry->value = value;
+    map->entries[index] = entry;
+    return 0;
+}
+
+static void *legacy_search(Legacy *map, unsigned int key)
+{
+    int index = legacy_hash(key, map->size);
+    if (map->entries[index] != NULL && map->entries[index]->key == key)
+        return map->entries[index]->value;
+
+    return NULL;
+}
+
+static void legacy_delete(Legacy *map, unsigned int key)
+{
+    int index = legacy_hash(key, map->size);
+    if (map->entries[index] != NULL)
+    {
+        free(map->entries[index]);
+        map->entries[index] = NULL;
+    }
+}
+
+static void legacy_free(Legacy *map)
+{
+    for (int i = 0; i < map->size; i++)
+        free(map->entries[i]);
+
+    free(map->entries);
+    free(map);
+}
+
+/*
+ * benchmark driver
+ *
+ */
+typedef struct
+{
+    double insert_ns, search_ns, delete_ns;
+    double hit_rate; // fraction of inserted keys that can be found again
+} Result;
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// six digit pickup codes, like generate_rand_6digit()
+static unsigned int *make_keys(int n)
+{
+    unsigned int *keys = malloc(sizeof(unsigned int) * n);
+    for (int i = 0; i < n; ++i)
+        keys[i] = 100000 + rand() % 900000;
+    return keys;
+}
+
+static Result run_legacy(unsigned int *keys, int n)
+{
+    Result r = {0};
+    Legacy *map = legacy_create(LEGACY_SIZE);
+    int found = 0;
+    double t;
+
+    t = now_ns();
+    for (int i = 0; i < n; ++i)
+        legacy_insert(map, keys[i], keys + i);
+    r.insert_ns = (now_ns() - t) / n;
+
+    t = now_ns();
+    for (int i = 0; i < n; ++i)
+        found += legacy_search(map, keys[i]) == keys + i;
+    r.search_ns = (now_ns() - t) / n;
+    r.hit_rate = (double)found / n;
+
+    t = now_ns();
+    for (int i = 0; i < n; ++i)
+        legacy_delete(map, keys[i]);
+    r.delete_ns = (now_ns() - t) / n;
+
+    legacy_free(map);
+    return r;
+}
+
+static Result run_hashmap(unsigned int *keys, int n)
+{
+    Result r = {0};
+    Hashmap *map = createHashmap(LEGACY_SIZE);
+    int found = 0;
+    double t;
+
+    t = now_ns();
+    for (int i = 0; i < n; ++i)
+        hashmap_insert(map, keys[i], keys + i);
+    r.insert_ns = (now_ns() - t) / n;
+
+    // a duplicate code keeps its first value, count it as found like the legacy table
+    t = now_ns();
+    for (int i = 0; i < n; ++i)
+        found += hashmap_search(map, keys[i]) != NULL;
+    r.search_ns = (now_ns() - t) / n;
+    r.hit_rate = (double)found / n;
+
+    t = now_ns();
+    for (int i = 0; i < n; ++i)
+        hashmap_delete(map, keys[i]);
+    r.delete_ns = (now_ns() - t) / n;
+
+    freeHashmap(map);
+    return r;
+}
+
+static void report(const char *name, int n, Result (*run)(unsigned int *, int))
+{
+    Result best = {1e18, 1e18, 1e18, 0};
+
+    // best of ROUNDS on the same key set, keeps scheduler noise out
+    srand(n);
+    unsigned int *keys = make_keys(n);
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        Result r = run(keys, n);
+        if (r.insert_ns < best.insert_ns)
+            best.insert_ns = r.insert_ns;
+        if (r.search_ns < best.search_ns)
+            best.search_ns = r.search_ns;
+        if (r.delete_ns < best.delete_ns)
+            best.delete_ns = r.delete_ns;
+        best.hit_rate = r.hit_rate;
+    }
+    free(keys);
+
+    printf("%-8s %8d %10.1f %10.1f %10.1f %8.1f%%\n", name, n,
+           best.insert_ns, best.search_ns, best.delete_ns, best.hit_rate * 100);
+}
+
+int main()
+{
+    int sizes[] = {16, 64, 256, 4096, 65536, 500000};
+
+    printf("%-8s %8s %10s %10s %10s %9s\n", "table", "keys", "insert/ns", "search/ns", "delete/ns", "found");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        report("legacy", sizes[i], run_legacy);
+        report("robin", sizes[i], run_hashmap);
+    }
+
+    return 0;
+}
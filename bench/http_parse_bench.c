@@ -0,0 +1,393 @@
+/*
+ * differential fuzz and throughput: mg_http_parse with the SSE2 and AVX2
+ * head scanners against the previous byte at a time parser
+ *
+ * mongoose.c is compiled in, so the scanner level can be pinned and the old
+ * parser can reuse its static helpers. The fuzz parses generated and mutated
+ * heads with every level the CPU has, and the whole mg_http_message and the
+ * return value must match the old parser. The heads sit at the very end of
+ * their allocation, build with -fsanitize=address to catch reads past them.
+ * It exits 1 on the first mismatch.
+ *
+ * gcc bench/http_parse_bench.c -Iinclude -O3 -o http_parse_bench
+ * ./http_parse_bench [cases] [seed]
+ */
+#include "../mongoose.c"
+
+#include <time.h>
+
+#define FUZZ_CASES 300000
+#define HEAD_MAX 8192
+#define BENCH_BYTES (64 << 20) // parsed per row
+
+#if !MG_ENABLE_SIMD
+static int s_mg_scan_max; // only the scalar scanners are built, nothing reads it
+#endif
+
+/*
+ * the previous parser, kept verbatim apart from the names
+ */
+static int legacy_get_request_len(const unsigned char *buf, size_t buf_len)
+{
+    size_t i;
+    for (i = 0; i < buf_len; i++)
+    {
+        if (!isok(buf[i]))
+            return -1;
+        if ((i > 0 && buf[i] == '\n' && buf[i - 1] == '\n') ||
+            (i > 3 && buf[i] == '\n' && buf[i - 1] == '\r' && buf[i - 2] == '\n'))
+            return (int)i + 1;
+    }
+    return 0;
+}
+
+static const char *legacy_skiptorn(const char *s, const char *end, struct mg_str *v)
+{
+    v->buf = (char *)s;
+    while (s < end && s[0] != '\n' && s[0] != '\r')
+        s++, v->len++;
+    if (s >= end || (s[0] == '\r' && s[1] != '\n'))
+        return NULL;
+    if (s < end && s[0] == '\r')
+        s++;
+    if (s >= end || *s++ != '\n')
+        return NULL;
+    return s;
+}
+
+static bool legacy_parse_headers(const char *s, const char *end,
+                                 struct mg_http_header *h, size_t max_hdrs)
+{
+    size_t i, n;
+    for (i = 0; i < max_hdrs; i++)
+    {
+        struct mg_str k = {NULL, 0}, v = {NULL, 0};
+        if (s >= end)
+            return false;
+        if (s[0] == '\n' || (s[0] == '\r' && s[1] == '\n'))
+            break;
+        k.buf = (char *)s;
+        while (s < end && s[0] != ':' && (n = clen(s, end)) > 0)
+            s += n, k.len += n;
+        if (k.len == 0)
+            return false;
+        if (s >= end || clen(s, end) == 0)
+            return false;
+        if (*s++ != ':')
+            return false;
+        while (s < end && s[0] == ' ')
+            s++;
+        if ((s = legacy_skiptorn(s, end, &v)) == NULL)
+            return false;
+        while (v.len > 0 && v.buf[v.len - 1] == ' ')
+            v.len--;
+        h[i].name = k, h[i].value = v;
+    }
+    return true;
+}
+
+static int legacy_parse(const char *s, size_t len, struct mg_http_message *hm)
+{
+    int is_response, req_len = legacy_get_request_len((unsigned char *)s, len);
+    const char *end = s == NULL ? NULL : s + req_len, *qs;
+    const struct mg_str *cl;
+    size_t n;
+
+    memset(hm, 0, sizeof(*hm));
+    if (req_len <= 0)
+        return req_len;
+
+    hm->message.buf = hm->head.buf = (char *)s;
+    hm->body.buf = (char *)end;
+    hm->head.len = (size_t)req_len;
+    hm->message.len = hm->body.len = (size_t)-1;
+
+    hm->method.buf = (char *)s;
+    while (s < end && (n = clen(s, end)) > 0)
+        s += n, hm->method.len += n;
+    while (s < end && s[0] == ' ')
+        s++;
+    hm->uri.buf = (char *)s;
+    while (s < end && (n = clen(s, end)) > 0)
+        s += n, hm->uri.len += n;
+    while (s < end && s[0] == ' ')
+        s++;
+    if ((s = legacy_skiptorn(s, end, &hm->proto)) == NULL)
+        return false;
+
+    if ((qs = (const char *)memchr(hm->uri.buf, '?', hm->uri.len)) != NULL)
+    {
+        hm->query.buf = (char *)qs + 1;
+        hm->query.len = (size_t)(&hm->uri.buf[hm->uri.len] - (qs + 1));
+        hm->uri.len = (size_t)(qs - hm->uri.buf);
+    }
+
+    if (hm->method.len == 0 || hm->uri.len == 0)
+        return -1;
+
+    if (!legacy_parse_headers(s, end, hm->headers,
+                              sizeof(hm->headers) / sizeof(hm->headers[0])))
+        return -1;
+    if ((cl = mg_http_get_header(hm, "Content-Length")) != NULL)
+    {
+        if (mg_to_size_t(*cl, &hm->body.len) == false)
+            return -1;
+        hm->message.len = (size_t)req_len + hm->body.len;
+    }
+
+    is_response = mg_ncasecmp(hm->method.buf, "HTTP/", 5) == 0;
+    if (hm->body.len == (size_t)~0 && !is_response &&
+        mg_strcasecmp(hm->method, mg_str("PUT")) != 0 &&
+        mg_strcasecmp(hm->method, mg_str("POST")) != 0)
+    {
+        hm->body.len = 0;
+        hm->message.len = (size_t)req_len;
+    }
+
+    if (hm->body.len == (size_t)~0 && is_response &&
+        mg_strcasecmp(hm->uri, mg_str("204")) == 0)
+    {
+        hm->body.len = 0;
+        hm->message.len = (size_t)req_len;
+    }
+    if (hm->message.len < (size_t)req_len)
+        return -1;
+
+    return req_len;
+}
+
+/*
+ * head generator
+ *
+ */
+static const char *level_names[] = {"scalar", "sse2", "avx2"};
+
+// bytes that steer the parser: separators, controls, the ends of the plain range, utf-8 lead and continuation
+static const unsigned char odd_bytes[] = {' ', ':', '\r', '\n', '\t', 0, 0x7f, '~', '}', '!', '?',
+                                          0x80, 0xbf, 0xc3, 0xe2, 0xf0, 0xf8, 0xff};
+
+static unsigned long long rng_state;
+
+static unsigned rng()
+{
+    rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned)(rng_state >> 33);
+}
+
+static size_t put(char *buf, size_t len, const char *s)
+{
+    size_t n = strlen(s);
+    if (len + n > HEAD_MAX)
+        n = HEAD_MAX - len;
+    memcpy(buf + len, s, n);
+    return len + n;
+}
+
+// a run of mostly plain text, sometimes a long one, sometimes with odd bytes or utf-8 in it
+static size_t put_text(char *buf, size_t len, int odd)
+{
+    static const char plain[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_./=;,";
+    static const char *utf8[] = {"\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x93\x81", "\xc3", "\xe2\x82"};
+    size_t n = rng() % 4 == 0 ? rng() % 200 : rng() % 40;
+
+    for (size_t i = 0; i < n && len < HEAD_MAX; ++i)
+    {
+        unsigned r = rng() % 64;
+        if (odd && r == 0)
+            buf[len++] = (char)odd_bytes[rng() % sizeof(odd_bytes)];
+        else if (odd && r == 1)
+            len = put(buf, len, utf8[rng() % 5]);
+        else if (r == 2)
+            buf[len++] = ' ';
+        else
+            buf[len++] = plain[rng() % (sizeof(plain) - 1)];
+    }
+    return len;
+}
+
+static size_t make_head(char *buf)
+{
+    static const char *methods[] = {"GET", "POST", "PUT", "HEAD", "HTTP/1.1", "DELETE"};
+    static const char *names[] = {"Host", "Content-Length", "Content-Type", "Cookie", "User-Agent", "Accept"};
+    const char *eol = rng() % 8 == 0 ? "\n" : "\r\n";
+    int odd = rng() % 2, headers = rng() % 4 == 0 ? rng() % 40 : rng() % 12;
+    size_t len = 0;
+
+    len = put(buf, len, methods[rng() % 6]);
+    len = put(buf, len, rng() % 16 ? " /" : "  ");
+    len = put_text(buf, len, odd);
+    if (rng() % 2)
+        len = put_text(buf, put(buf, len, "?"), odd);
+    len = put(buf, len, rng() % 8 ? " HTTP/1.1" : "");
+    len = put(buf, len, eol);
+
+    for (int i = 0; i < headers; ++i)
+    {
+        if (rng() % 2)
+            len = put(buf, len, names[rng() % 6]);
+        else
+            len = put_text(buf, len, odd);
+        len = put(buf, len, rng() % 16 ? ": " : ":");
+        if (rng() % 4 == 0)
+        {
+            char num[32];
+            snprintf(num, sizeof(num), "%u", rng() % 100000);
+            len = put(buf, len, num);
+        }
+        else
+            len = put_text(buf, len, odd);
+        len = put(buf, len, rng() % 32 ? eol : "\r");
+    }
+    len = put(buf, len, eol);
+    if (rng() % 4 == 0)
+        len = put_text(buf, len, 1); // a body, or the next request
+
+    for (int flips = odd ? rng() % 4 : 0; flips > 0 && len > 0; --flips)
+        buf[rng() % len] = (char)(rng() % 2 ? odd_bytes[rng() % sizeof(odd_bytes)] : rng());
+    if (rng() % 8 == 0 && len > 0)
+        len = rng() % len; // cut short, still being received
+    return len;
+}
+
+static void dump(const char *s, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= ' ' && c < 0x7f && c != '\\')
+            fputc(c, stderr);
+        else
+            fprintf(stderr, "\\x%02x", c);
+    }
+    fputc('\n', stderr);
+}
+
+/*
+ * benchmark driver
+ *
+ */
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int level_max()
+{
+#if MG_ENABLE_SIMD
+    return __builtin_cpu_supports("avx2") ? 2 : 1;
+#else
+    return 0;
+#endif
+}
+
+static int fuzz(long cases)
+{
+    char *head = malloc(HEAD_MAX);
+    struct mg_http_message want, got;
+    long ok = 0;
+
+    for (long c = 0; c < cases; ++c)
+    {
+        size_t len = make_head(head);
+        char *buf = malloc(len ? len : 1), *s = buf + (len ? 0 : 1); // nothing readable after the last byte
+        memcpy(buf, head, len);
+
+        int want_ret = legacy_parse(s, len, &want);
+        ok += want_ret > 0;
+        for (int level = 0; level <= level_max(); ++level)
+        {
+            s_mg_scan_max = level;
+            int got_ret = mg_http_parse(s, len, &got);
+            if (got_ret != want_ret || memcmp(&got, &want, sizeof(got)) != 0)
+            {
+                fprintf(stderr, "mismatch at case %ld, %s returned %d, expected %d, head:\n",
+                        c, level_names[level], got_ret, want_ret);
+                dump(s, len);
+                return 1;
+            }
+        }
+        free(buf);
+    }
+
+    s_mg_scan_max = 2;
+    free(head);
+    printf("fuzz: %ld heads, %ld complete, levels scalar..%s agree with the old parser\n",
+           cases, ok, level_names[level_max()]);
+    return 0;
+}
+
+static volatile int sink;
+
+static double time_parse(const char *req, int level)
+{
+    size_t len = strlen(req);
+    long n = BENCH_BYTES / len;
+    struct mg_http_message hm;
+    double t;
+
+    s_mg_scan_max = level;
+    t = now_ns();
+    for (long i = 0; i < n; ++i)
+        sink += level < 0 ? legacy_parse(req, len, &hm) : mg_http_parse(req, len, &hm);
+    return (now_ns() - t) / n;
+}
+
+static void report(const char *name, const char *req)
+{
+    double base = time_parse(req, -1);
+
+    printf("%-10s %6zu %-8s %10.1f %10.0f %8s\n", name, strlen(req), "old", base,
+           strlen(req) / base * 1e3, "1.00");
+    for (int level = 0; level <= level_max(); ++level)
+    {
+        double t = time_parse(req, level);
+        printf("%-10s %6zu %-8s %10.1f %10.0f %8.2f\n", name, strlen(req), level_names[level], t,
+               strlen(req) / t * 1e3, base / t);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static char cookie[4096];
+    long cases = argc > 1 ? atol(argv[1]) : FUZZ_CASES;
+    rng_state = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+
+    if (fuzz(cases))
+        return 1;
+
+    // a FileBay chunk upload, a browser page load, and one with a long cookie
+    const char *upload =
+        "POST /api/upload?code=12345678&pass=abcd HTTP/1.1\r\n"
+        "Host: 127.0.0.1:8080\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "Content-Length: 1048576\r\n"
+        "\r\n";
+    const char *browser =
+        "GET /api/download?code=12345678&pass=abcd HTTP/1.1\r\n"
+        "Host: filebay.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+        "Referer: https://filebay.example.com/\r\n"
+        "Connection: keep-alive\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "Sec-Fetch-Dest: document\r\n"
+        "Sec-Fetch-Mode: navigate\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "Priority: u=0, i\r\n"
+        "\r\n";
+    size_t len = (size_t)snprintf(cookie, sizeof(cookie), "%.*sCookie: ",
+                                  (int)(strlen(browser) - 2), browser);
+    for (int i = 0; len < 3000; ++i)
+        len += (size_t)snprintf(cookie + len, sizeof(cookie) - len, "session_%02d=%032x; ", i, i * 2654435761u);
+    snprintf(cookie + len, sizeof(cookie) - len, "\r\n\r\n");
+
+    printf("\n%-10s %6s %-8s %10s %10s %8s\n", "request", "bytes", "parser", "ns/parse", "MB/s", "speedup");
+    report("upload", upload);
+    report("browser", browser);
+    report("cookie", cookie);
+    return 0;
+}
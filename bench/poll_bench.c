@@ -0,0 +1,129 @@
+/*
+ * microbenchmark: one request/response round trip through mg_mgr_poll()
+ * while N idle connections sit in the same manager, like status WebSockets
+ *
+ * with epoll only the connections that got an event or have data to move are
+ * visited, idle ones get no MG_EV_POLL. The poll(2) build walks every
+ * connection on every iteration, build it too to compare:
+ *
+ * gcc bench/poll_bench.c mongoose.c -Iinclude -O3 -o poll_bench
+ * gcc bench/poll_bench.c mongoose.c -Iinclude -O3 -DMG_ENABLE_EPOLL=0 -DMG_ENABLE_POLL=1 -o poll_bench_poll
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mongoose.h"
+
+#define ROUNDS 20000
+
+static unsigned long idle_polls;
+
+static void idle_cb(struct mg_connection *c, int ev, void *ev_data)
+{
+    if (ev == MG_EV_POLL)
+        idle_polls++;
+    (void)c, (void)ev_data;
+}
+
+static void echo_cb(struct mg_connection *c, int ev, void *ev_data)
+{
+    if (ev == MG_EV_READ)
+    {
+        mg_send(c, c->recv.buf, c->recv.len);
+        c->recv.len = 0;
+    }
+    (void)ev_data;
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// wrap one end of a socketpair, the other end is the peer
+static int pair(struct mg_mgr *mgr, mg_event_handler_t fn)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        return -1;
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    if (mg_wrapfd(mgr, sv[0], fn, NULL) == NULL)
+    {
+        close(sv[0]), close(sv[1]);
+        return -1;
+    }
+    return sv[1];
+}
+
+static void run(int n)
+{
+    struct mg_mgr mgr;
+    int *peers = malloc(sizeof(int) * (n + 1)), active, made = 0;
+    unsigned long polls = 0;
+    char ch = 'x';
+    double t;
+
+    mg_mgr_init(&mgr);
+    while (made < n && (peers[made] = pair(&mgr, idle_cb)) >= 0)
+        made++;
+    active = pair(&mgr, echo_cb);
+    if (made < n || active < 0)
+    {
+        printf("%8d  out of descriptors, raise ulimit -n\n", n);
+        goto done;
+    }
+    // every connection starts with a writable event, MG_EPOLL_EVENTS at a time
+    for (int i = 0; i < n / MG_EPOLL_EVENTS + 2; ++i)
+        mg_mgr_poll(&mgr, 0);
+
+    idle_polls = 0;
+    t = now_ns();
+    for (int i = 0; i < ROUNDS; ++i)
+    {
+        if (send(active, &ch, 1, 0) != 1)
+            break;
+        do
+        {
+            mg_mgr_poll(&mgr, 100);
+            polls++;
+        } while (recv(active, &ch, 1, MSG_DONTWAIT) != 1);
+    }
+    t = now_ns() - t;
+
+    printf("%8d %12.0f %12.2f %14.2f\n", n, t / ROUNDS, (double)polls / ROUNDS,
+           (double)idle_polls / ROUNDS);
+    close(active);
+
+done:
+    mg_mgr_free(&mgr);
+    for (int i = 0; i < made; ++i)
+        close(peers[i]);
+    free(peers);
+}
+
+int main()
+{
+    int sizes[] = {0, 100, 1000, 9000};
+    struct rlimit rl;
+
+    // every idle connection is a socketpair, two descriptors
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    mg_log_set(MG_LL_ERROR);
+
+    printf("%8s %12s %12s %14s\n", "idle", "ns/roundtrip", "polls/trip", "idle POLL/trip");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+        run(sizes[i]);
+
+    return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * microbenchmark: mongoose timers on the timing wheel against the previous
+ * singly linked timer list
+ *
+ * every timer repeats with a period between 1 and 60 seconds, like idle or
+ * rate limit timers hanging off connections. The loop is polled every
+ * POLL_STEP ms of simulated time for SIM_MS. Both sides see the same
+ * schedule, so their fired columns must match.
+ *
+ * gcc bench/timer_bench.c mongoose.c -Iinclude -O3 -o timer_bench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mongoose.h"
+
+#define SIM_MS 60000
+#define POLL_STEP 10
+#define START_MS 1000000
+#define CANCEL_NUM 10000
+
+/*
+ * the previous timer list, kept verbatim apart from the names: new timers
+ * are pushed to the head, every poll visits every timer
+ */
+#define LEGACY_CALLED 4
+
+typedef struct LegacyTimer
+{
+    uint64_t period_ms;
+    uint64_t expire;
+    unsigned flags;
+    void (*fn)(void *);
+    void *arg;
+    struct LegacyTimer *next;
+} LegacyTimer;
+
+static void legacy_init(LegacyTimer **head, LegacyTimer *t, uint64_t ms,
+                        unsigned flags, void (*fn)(void *), void *arg)
+{
+    t->period_ms = ms, t->expire = 0;
+    t->flags = flags, t->fn = fn, t->arg = arg, t->next = *head;
+    *head = t;
+}
+
+static void legacy_free(LegacyTimer **head, LegacyTimer *t)
+{
+    while (*head && *head != t)
+        head = &(*head)->next;
+    if (*head)
+        *head = t->next;
+}
+
+static void legacy_poll(LegacyTimer **head, uint64_t now_ms)
+{
+    LegacyTimer *t, *tmp;
+    for (t = *head; t != NULL; t = tmp)
+    {
+        bool once = t->expire == 0 && (t->flags & MG_TIMER_RUN_NOW) &&
+                    !(t->flags & LEGACY_CALLED);
+        bool expired = mg_timer_expired(&t->expire, t->period_ms, now_ms);
+        tmp = t->next;
+        if (!once && !expired)
+            continue;
+        if ((t->flags & MG_TIMER_REPEAT) || !(t->flags & LEGACY_CALLED))
+            t->fn(t->arg);
+        t->flags |= LEGACY_CALLED;
+    }
+}
+
+/*
+ * benchmark driver
+ *
+ */
+typedef struct
+{
+    double add_ns, poll_ns, cancel_ns;
+    unsigned long fired;
+} Result;
+
+static unsigned long fired;
+
+static void on_timer(void *arg)
+{
+    fired++;
+    (void)arg;
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t *make_periods(int n)
+{
+    uint64_t *periods = malloc(sizeof(uint64_t) * n);
+    for (int i = 0; i < n; ++i)
+        periods[i] = 1000 + rand() % 59000;
+    return periods;
+}
+
+static int *make_victims(int n)
+{
+    int *victims = malloc(sizeof(int) * CANCEL_NUM);
+    for (int i = 0; i < CANCEL_NUM; ++i)
+        victims[i] = rand() % n;
+    return victims;
+}
+
+static Result run_legacy(uint64_t *periods, int *victims, int n)
+{
+    Result r = {0};
+    LegacyTimer *head = NULL, *timers = calloc(n, sizeof(LegacyTimer));
+    double t;
+
+    fired = 0;
+    t = now_ns();
+    for (int i = 0; i < n; ++i)
+        legacy_init(&head, timers + i, periods[i], MG_TIMER_REPEAT, on_timer, NULL);
+    r.add_ns = (now_ns() - t) / n;
+
+    t = now_ns();
+    for (uint64_t ms = START_MS; ms <= START_MS + SIM_MS; ms += POLL_STEP)
+        legacy_poll(&head, ms);
+    r.poll_ns = (now_ns() - t) / (SIM_MS / POLL_STEP + 1);
+    r.fired = fired;
+
+    // a victim may be picked twice, the second free walks the whole list for nothing
+    t = now_ns();
+    for (int i = 0; i < CANCEL_NUM; ++i)
+        legacy_free(&head, timers + victims[i]);
+    r.cancel_ns = (now_ns() - t) / CANCEL_NUM;
+
+    free(timers);
+    return r;
+}
+
+static Result run_wheel(uint64_t *periods, int *victims, int n)
+{
+    Result r = {0};
+    struct mg_timer_wheel *wheel = calloc(1, sizeof(struct mg_timer_wheel));
+    struct mg_timer *timers = calloc(n, sizeof(struct mg_timer));
+    double t;
+
+    fired = 0;
+    t = now_ns();
+    for (int i = 0; i < n; ++i)
+        mg_timer_init(wheel, timers + i, periods[i], MG_TIMER_REPEAT, on_timer, NULL);
+    r.add_ns = (now_ns() - t) / n;
+
+    t = now_ns();
+    for (uint64_t ms = START_MS; ms <= START_MS + SIM_MS; ms += POLL_STEP)
+        mg_timer_poll(wheel, ms);
+    r.poll_ns = (now_ns() - t) / (SIM_MS / POLL_STEP + 1);
+    r.fired = fired;
+
+    t = now_ns();
+    for (int i = 0; i < CANCEL_NUM; ++i)
+        mg_timer_free(wheel, timers + victims[i]);
+    r.cancel_ns = (now_ns() - t) / CANCEL_NUM;
+
+    free(timers);
+    free(wheel);
+    return r;
+}
+
+static void report(const char *name, int n, Result (*run)(uint64_t *, int *, int))
+{
+    srand(n);
+    uint64_t *periods = make_periods(n);
+    int *victims = make_victims(n);
+
+    Result r = run(periods, victims, n);
+    free(periods);
+    free(victims);
+
+    printf("%-8s %8d %10.1f %12.1f %10.1f %10lu\n", name, n,
+           r.add_ns, r.poll_ns, r.cancel_ns, r.fired);
+}
+
+int main()
+{
+    int sizes[] = {100, 1000, 10000, 100000};
+
+    printf("%-8s %8s %10s %12s %10s %10s\n", "timers", "count", "add/ns", "poll/ns", "cancel/ns", "fired");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        report("list", sizes[i], run_legacy);
+        report("wheel", sizes[i], run_wheel);
+    }
+
+    return 0;
+}
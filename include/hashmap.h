@@ -1,105 +1,210 @@
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define HASHMAP_MIN_SIZE 8
+#define HASHMAP_MAX_LOAD 0.875 // grow once more than 7/8 of the slots are used
+
 typedef struct
 {
-    unsigned int key;
+    uint64_t key;
     void *value;
+    uint32_t dist; // probe distance + 1, 0 marks an empty slot
 } HashmapEntry;
 
 /*
- * general implement for hasmap
+ * general implement for hashmap
  *
- * Warning! the hashmap implement cannot deal with hash collision!
+ * open addressing with robin hood probing: an entry that is further from its
+ * home slot takes the place of a closer one, which keeps probe sequences
+ * short. Deletion shifts the following entries back instead of leaving
+ * tombstones, and the table doubles when the load factor passes
+ * HASHMAP_MAX_LOAD.
  */
 typedef struct
 {
-    HashmapEntry **entries;
-    int size;
+    HashmapEntry *entries;
+    size_t size; // number of slots, always a power of two
+    size_t count;
 } Hashmap;
 
-unsigned int hash(unsigned int key, int hashmapSize);
-Hashmap *createHashmap(int size);
-void insert(Hashmap *hashmap, unsigned int key, void *value);
-void *search(Hashmap *hashmap, unsigned int key);
-void delete(Hashmap *hashmap, unsigned int key);
+uint64_t hashmap_hash(uint64_t key);
+Hashmap *createHashmap(size_t size);
+int hashmap_insert(Hashmap *hashmap, uint64_t key, void *value);
+int hashmap_put(Hashmap *hashmap, uint64_t key, void *value);
+void *hashmap_search(Hashmap *hashmap, uint64_t key);
+int hashmap_delete(Hashmap *hashmap, uint64_t key);
 void freeHashmap(Hashmap *hashmap);
 
 #ifdef HASHMAP_IMPLEMENTATION
-unsigned int hash(unsigned int key, int hashmapSize)
+uint64_t hashmap_hash(uint64_t key)
 {
-    key = ((key >> 16) ^ key) * 0x45d9f3b;
-    key = ((key >> 16) ^ key) * 0x45d9f3b;
-    key = (key >> 16) ^ key;
-
-    return key % hashmapSize;
+    // splitmix64 finalizer, spreads sequential keys over the whole table
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
 }
 
-Hashmap *createHashmap(int size)
+Hashmap *createHashmap(size_t size)
 {
     Hashmap *hashmap = malloc(sizeof(Hashmap));
-    hashmap->size = size;
-    hashmap->entries = malloc(sizeof(HashmapEntry *) * size);
+    if (!hashmap)
+        return NULL;
+
+    hashmap->size = HASHMAP_MIN_SIZE;
+    while (hashmap->size < size)
+        hashmap->size <<= 1;
 
-    for (int i = 0; i < size; ++i)
+    hashmap->count = 0;
+    hashmap->entries = calloc(hashmap->size, sizeof(HashmapEntry));
+    if (!hashmap->entries)
     {
-        hashmap->entries[i] = NULL;
+        free(hashmap);
+        return NULL;
     }
 
     return hashmap;
 }
 
-// Insert an entry into the hashmap, return if collide, not insert if collide
-int hashmap_insert(Hashmap *hashmap, unsigned int key, void *value)
+// Return the slot holding the key, or -1 if it is absent.
+static long hashmap_find(Hashmap *hashmap, uint64_t key)
+{
+    size_t mask = hashmap->size - 1;
+    size_t index = hashmap_hash(key) & mask;
+
+    for (uint32_t dist = 1;; ++dist)
+    {
+        HashmapEntry *entry = hashmap->entries + index;
+
+        // a poorer entry here means ours would have displaced it
+        if (entry->dist < dist)
+            return -1;
+        if (entry->key == key)
+            return (long)index;
+
+        index = (index + 1) & mask;
+    }
+}
+
+// Place an entry whose key is known to be absent, the table must have room.
+static void hashmap_place(Hashmap *hashmap, HashmapEntry cur)
+{
+    size_t mask = hashmap->size - 1;
+    size_t index = hashmap_hash(cur.key) & mask;
+
+    for (cur.dist = 1;; ++cur.dist)
+    {
+        HashmapEntry *entry = hashmap->entries + index;
+
+        if (entry->dist == 0)
+        {
+            *entry = cur;
+            hashmap->count++;
+            return;
+        }
+
+        if (entry->dist < cur.dist)
+        {
+            HashmapEntry tmp = *entry;
+            *entry = cur;
+            cur = tmp;
+        }
+
+        index = (index + 1) & mask;
+    }
+}
+
+static int hashmap_grow(Hashmap *hashmap)
 {
-    int index = hash(key, hashmap->size);
+    HashmapEntry *old = hashmap->entries;
+    size_t old_size = hashmap->size;
 
-    if (hashmap->entries[index] != NULL)
+    HashmapEntry *entries = calloc(old_size << 1, sizeof(HashmapEntry));
+    if (!entries)
+        return -1;
+
+    hashmap->entries = entries;
+    hashmap->size = old_size << 1;
+    hashmap->count = 0;
+
+    for (size_t i = 0; i < old_size; ++i)
+    {
+        if (old[i].dist)
+            hashmap_place(hashmap, old[i]);
+    }
+
+    free(old);
+    return 0;
+}
+
+// Insert an entry into the hashmap, return 1 if the key exists, -1 if out of memory.
+int hashmap_insert(Hashmap *hashmap, uint64_t key, void *value)
+{
+    if (hashmap_find(hashmap, key) >= 0)
         return 1;
 
-    HashmapEntry *entry = malloc(sizeof(HashmapEntry));
-    entry->key = key;
-    entry->value = value;
+    if (hashmap->count + 1 > hashmap->size * HASHMAP_MAX_LOAD && hashmap_grow(hashmap))
+        return -1;
 
-    hashmap->entries[index] = entry;
+    HashmapEntry entry = {.key = key, .value = value};
+    hashmap_place(hashmap, entry);
     return 0;
 }
 
-// Search for an entry in the hashmap.
-void *hashmap_search(Hashmap *hashmap, unsigned int key)
+// Insert or replace an entry, return -1 if out of memory.
+int hashmap_put(Hashmap *hashmap, uint64_t key, void *value)
 {
-    int index = hash(key, hashmap->size);
-    if (hashmap->entries[index] != NULL && hashmap->entries[index]->key == key)
+    long index = hashmap_find(hashmap, key);
+    if (index >= 0)
     {
-        return hashmap->entries[index]->value;
+        hashmap->entries[index].value = value;
+        return 0;
     }
 
-    return NULL;
+    return hashmap_insert(hashmap, key, value);
+}
+
+// Search for an entry in the hashmap.
+void *hashmap_search(Hashmap *hashmap, uint64_t key)
+{
+    long index = hashmap_find(hashmap, key);
+    return index >= 0 ? hashmap->entries[index].value : NULL;
 }
 
-// Delete an entry from the hashmap.
-void hashmap_delete(Hashmap *hashmap, unsigned int key)
+// Delete an entry from the hashmap, return 1 if the key does not exist.
+int hashmap_delete(Hashmap *hashmap, uint64_t key)
 {
-    int index = hash(key, hashmap->size);
-    if (hashmap->entries[index] != NULL)
+    long found = hashmap_find(hashmap, key);
+    if (found < 0)
+        return 1;
+
+    size_t mask = hashmap->size - 1;
+    size_t index = (size_t)found;
+
+    // backward shift: pull displaced successors one slot closer to home
+    for (;;)
     {
-        free(hashmap->entries[index]);
-        hashmap->entries[index] = NULL;
+        size_t next = (index + 1) & mask;
+        if (hashmap->entries[next].dist <= 1)
+            break;
+
+        hashmap->entries[index] = hashmap->entries[next];
+        hashmap->entries[index].dist--;
+        index = next;
     }
+
+    hashmap->entries[index].dist = 0;
+    hashmap->count--;
+    return 0;
 }
 
 // Free the hashmap.
 void freeHashmap(Hashmap *hashmap)
 {
-    for (int i = 0; i < hashmap->size; i++)
-    {
-        if (hashmap->entries[i] != NULL)
-        {
-            free(hashmap->entries[i]);
-        }
-    }
+    if (!hashmap)
+        return;
 
     free(hashmap->entries);
     free(hashmap);
 }
-#endif
\ No newline at end of file
+#endif
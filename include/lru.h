@@ -0,0 +1,166 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// needs hashmap.h included before it
+
+typedef struct LruEntry
+{
+    uint64_t key;
+    struct LruEntry *prev, *next; // recency list, most recent first
+    char etag[32];                // validators, filled in by the caller after lru_put
+    char last_modified[32];
+    size_t len;
+    char data[];
+} LruEntry;
+
+/*
+ * general implement for byte budgeted LRU cache
+ *
+ * every entry owns a copy of its data. A hit moves the entry to the front
+ * of the recency list, an insert evicts from the back until the cached
+ * bytes fit in max_byte again. Lookups go through a Hashmap, so get, put
+ * and delete are O(1).
+ */
+typedef struct
+{
+    Hashmap *index; // key -> LruEntry
+    LruEntry *head, *tail;
+    size_t max_byte;
+    size_t byte; // data bytes currently cached
+    size_t count;
+    uint64_t hits, misses;
+} LruCache;
+
+LruCache *createLruCache(size_t max_byte);
+LruEntry *lru_get(LruCache *cache, uint64_t key);
+LruEntry *lru_put(LruCache *cache, uint64_t key, const void *data, size_t len);
+int lru_delete(LruCache *cache, uint64_t key);
+void freeLruCache(LruCache *cache);
+
+#ifdef LRU_IMPLEMENTATION
+LruCache *createLruCache(size_t max_byte)
+{
+    LruCache *cache = calloc(1, sizeof(LruCache));
+    if (!cache)
+        return NULL;
+
+    cache->index = createHashmap(0);
+    if (!cache->index)
+    {
+        free(cache);
+        return NULL;
+    }
+
+    cache->max_byte = max_byte;
+    return cache;
+}
+
+static void lru_unlink(LruCache *cache, LruEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache->head = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+}
+
+static void lru_push_front(LruCache *cache, LruEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+
+    if (cache->head)
+        cache->head->prev = entry;
+    else
+        cache->tail = entry;
+
+    cache->head = entry;
+}
+
+static void lru_remove(LruCache *cache, LruEntry *entry)
+{
+    lru_unlink(cache, entry);
+    hashmap_delete(cache->index, entry->key);
+    cache->byte -= entry->len;
+    cache->count--;
+    free(entry);
+}
+
+// Look an entry up and mark it most recently used, counts a hit or a miss.
+LruEntry *lru_get(LruCache *cache, uint64_t key)
+{
+    LruEntry *entry = hashmap_search(cache->index, key);
+    if (!entry)
+    {
+        cache->misses++;
+        return NULL;
+    }
+
+    cache->hits++;
+    if (entry != cache->head)
+    {
+        lru_unlink(cache, entry);
+        lru_push_front(cache, entry);
+    }
+    return entry;
+}
+
+// Copy data in under key, replacing an older entry. Return NULL if it can not fit.
+LruEntry *lru_put(LruCache *cache, uint64_t key, const void *data, size_t len)
+{
+    if (len > cache->max_byte)
+        return NULL;
+
+    LruEntry *entry = malloc(sizeof(LruEntry) + len);
+    if (!entry)
+        return NULL;
+
+    lru_delete(cache, key);
+    while (cache->tail && cache->byte + len > cache->max_byte)
+        lru_remove(cache, cache->tail);
+
+    if (hashmap_insert(cache->index, key, entry))
+    {
+        free(entry);
+        return NULL;
+    }
+
+    entry->key = key;
+    entry->etag[0] = entry->last_modified[0] = '\0';
+    entry->len = len;
+    memcpy(entry->data, data, len);
+    lru_push_front(cache, entry);
+    cache->byte += len;
+    cache->count++;
+    return entry;
+}
+
+// Drop an entry, return 1 if the key is not cached.
+int lru_delete(LruCache *cache, uint64_t key)
+{
+    LruEntry *entry = hashmap_search(cache->index, key);
+    if (!entry)
+        return 1;
+
+    lru_remove(cache, entry);
+    return 0;
+}
+
+// Free the cache and every entry.
+void freeLruCache(LruCache *cache)
+{
+    if (!cache)
+        return;
+
+    while (cache->head)
+        lru_remove(cache, cache->head);
+
+    freeHashmap(cache->index);
+    free(cache);
+}
+#endif
@@ -0,0 +1,86 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#define METRICS_BUCKETS 14
+
+// upper bounds of the histogram buckets in microseconds, 100us to 2.5s
+static const uint64_t metrics_bucket_us[METRICS_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000};
+
+/*
+ * general implement for single writer metrics
+ *
+ * a counter or histogram belongs to one thread, which updates it with a
+ * relaxed load and store, no locked instruction and no shared cache line
+ * with the other writers. Readers on other threads may see a value a few
+ * updates old, which is all a scrape needs. Sum the per thread copies with
+ * histogram_collect when the numbers are asked for.
+ */
+typedef _Atomic uint64_t Counter;
+
+typedef struct
+{
+    Counter bucket[METRICS_BUCKETS + 1]; // per bucket, not cumulative, the last one is +Inf
+    Counter sum_us;
+} Histogram;
+
+// plain totals, filled at scrape time
+typedef struct
+{
+    uint64_t bucket[METRICS_BUCKETS + 1];
+    uint64_t sum_us;
+    uint64_t count;
+} HistogramSum;
+
+uint64_t metrics_now_us();
+void counter_add(Counter *counter, uint64_t n);
+uint64_t counter_get(Counter *counter);
+void histogram_observe(Histogram *hist, uint64_t us);
+void histogram_collect(HistogramSum *sum, Histogram *hist);
+
+#ifdef METRICS_IMPLEMENTATION
+// Monotonic clock in microseconds.
+uint64_t metrics_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Add to a counter, owning thread only.
+void counter_add(Counter *counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+// Read a counter, safe from any thread.
+uint64_t counter_get(Counter *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Record one duration, owning thread only.
+void histogram_observe(Histogram *hist, uint64_t us)
+{
+    int i = 0;
+    while (i < METRICS_BUCKETS && us > metrics_bucket_us[i])
+        i++;
+
+    counter_add(hist->bucket + i, 1);
+    counter_add(&hist->sum_us, us);
+}
+
+// Add a histogram to the totals, safe from any thread.
+void histogram_collect(HistogramSum *sum, Histogram *hist)
+{
+    for (int i = 0; i <= METRICS_BUCKETS; ++i)
+    {
+        uint64_t n = counter_get(hist->bucket + i);
+        sum->bucket[i] += n;
+        sum->count += n;
+    }
+    sum->sum_us += counter_get(&hist->sum_us);
+}
+#endif
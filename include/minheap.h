@@ -0,0 +1,159 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MINHEAP_MIN_SIZE 16
+
+typedef struct
+{
+    int64_t key; // ordering key, the smallest one sits on top
+    int value;
+} HeapEntry;
+
+/*
+ * general implement for binary min-heap
+ *
+ * entries live in one array that doubles when full, push and pop are O(log n)
+ */
+typedef struct
+{
+    HeapEntry *entries;
+    size_t size;
+    size_t count;
+} MinHeap;
+
+MinHeap *createMinHeap(size_t size);
+int minheap_push(MinHeap *heap, int64_t key, int value);
+int minheap_build(MinHeap *heap, const HeapEntry *entries, size_t count);
+int minheap_peek(MinHeap *heap, HeapEntry *top);
+int minheap_pop(MinHeap *heap, HeapEntry *top);
+void freeMinHeap(MinHeap *heap);
+
+#ifdef MINHEAP_IMPLEMENTATION
+MinHeap *createMinHeap(size_t size)
+{
+    MinHeap *heap = malloc(sizeof(MinHeap));
+    if (!heap)
+        return NULL;
+
+    heap->size = size < MINHEAP_MIN_SIZE ? MINHEAP_MIN_SIZE : size;
+    heap->count = 0;
+    heap->entries = malloc(sizeof(HeapEntry) * heap->size);
+    if (!heap->entries)
+    {
+        free(heap);
+        return NULL;
+    }
+
+    return heap;
+}
+
+// Push an entry, return -1 if out of memory.
+int minheap_push(MinHeap *heap, int64_t key, int value)
+{
+    if (heap->count == heap->size)
+    {
+        HeapEntry *temp = realloc(heap->entries, sizeof(HeapEntry) * heap->size * 2);
+        if (!temp)
+            return -1;
+        heap->entries = temp;
+        heap->size *= 2;
+    }
+
+    // sift up
+    size_t i = heap->count++;
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+        if (heap->entries[parent].key <= key)
+            break;
+        heap->entries[i] = heap->entries[parent];
+        i = parent;
+    }
+
+    heap->entries[i].key = key;
+    heap->entries[i].value = value;
+    return 0;
+}
+
+// sift the entry at i down to its place among its children
+static void minheap_sift_down(MinHeap *heap, size_t i)
+{
+    HeapEntry cur = heap->entries[i];
+    for (;;)
+    {
+        size_t child = 2 * i + 1;
+        if (child >= heap->count)
+            break;
+        if (child + 1 < heap->count && heap->entries[child + 1].key < heap->entries[child].key)
+            child++;
+        if (cur.key <= heap->entries[child].key)
+            break;
+        heap->entries[i] = heap->entries[child];
+        i = child;
+    }
+
+    heap->entries[i] = cur;
+}
+
+// Add count entries at once and restore the order in O(n), return -1 if out of memory.
+int minheap_build(MinHeap *heap, const HeapEntry *entries, size_t count)
+{
+    if (heap->count + count > heap->size)
+    {
+        size_t size = heap->size;
+        while (size < heap->count + count)
+            size *= 2;
+
+        HeapEntry *temp = realloc(heap->entries, sizeof(HeapEntry) * size);
+        if (!temp)
+            return -1;
+        heap->entries = temp;
+        heap->size = size;
+    }
+
+    memcpy(heap->entries + heap->count, entries, sizeof(HeapEntry) * count);
+    heap->count += count;
+
+    // every parent from the last one up, the leaves are heaps already
+    for (size_t i = heap->count / 2; i > 0; --i)
+        minheap_sift_down(heap, i - 1);
+    return 0;
+}
+
+// Copy the smallest entry to top, return 1 if the heap is empty.
+int minheap_peek(MinHeap *heap, HeapEntry *top)
+{
+    if (heap->count == 0)
+        return 1;
+
+    *top = heap->entries[0];
+    return 0;
+}
+
+// Remove the smallest entry and copy it to top, return 1 if the heap is empty.
+int minheap_pop(MinHeap *heap, HeapEntry *top)
+{
+    if (heap->count == 0)
+        return 1;
+
+    if (top)
+        *top = heap->entries[0];
+
+    // sift the last entry down from the root
+    heap->entries[0] = heap->entries[--heap->count];
+    if (heap->count > 0)
+        minheap_sift_down(heap, 0);
+    return 0;
+}
+
+// Free the heap.
+void freeMinHeap(MinHeap *heap)
+{
+    if (!heap)
+        return;
+
+    free(heap->entries);
+    free(heap);
+}
+#endif
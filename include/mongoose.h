@@ -344,6 +344,17 @@ static inline int mg_mkdir(const char *path, mode_t mode) {
 #define MG_ENABLE_POLL 1
 #endif
 
+#if !defined(MG_ENABLE_SENDFILE) && defined(__linux__)
+#define MG_ENABLE_SENDFILE 1
+#endif
+
+#if !defined(MG_ENABLE_IO_URING) && defined(__linux__) && MG_ENABLE_EPOLL && \
+    defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define MG_ENABLE_IO_URING 1
+#endif
+#endif
+
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <dirent.h>
@@ -371,6 +382,16 @@ static inline int mg_mkdir(const char *path, mode_t mode) {
 #include <sys/select.h>
 #endif
 
+#if defined(MG_ENABLE_SENDFILE) && MG_ENABLE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#if defined(MG_ENABLE_IO_URING) && MG_ENABLE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -698,6 +719,30 @@ struct timeval {
 #define MG_ENABLE_EPOLL 0
 #endif
 
+#ifndef MG_EPOLL_EVENTS
+#define MG_EPOLL_EVENTS 256  // Events taken by one epoll_wait()
+#endif
+
+#ifndef MG_ENABLE_SENDFILE
+#define MG_ENABLE_SENDFILE 0  // Serve plaintext file bodies with sendfile(2)
+#endif
+
+#ifndef MG_ENABLE_IO_URING
+#define MG_ENABLE_IO_URING 0  // Batch socket IO, see mg_io_uring_init()
+#endif
+
+#ifndef MG_IO_URING_ENTRIES
+#define MG_IO_URING_ENTRIES 256  // Socket operations per io_uring_enter()
+#endif
+
+#ifndef MG_ENABLE_SIMD
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define MG_ENABLE_SIMD 1  // Scan HTTP heads with SSE2, or AVX2 if the CPU has it
+#else
+#define MG_ENABLE_SIMD 0
+#endif
+#endif
+
 #ifndef MG_ENABLE_FATFS
 #define MG_ENABLE_FATFS 0
 #endif
@@ -800,20 +845,15 @@ struct timeval {
 #endif
 
 #if MG_ENABLE_EPOLL
+// Registered once, edge triggered, never modified: see mg_iotest()
 #define MG_EPOLL_ADD(c)                                                    \
   do {                                                                     \
-    struct epoll_event ev = {EPOLLIN | EPOLLERR | EPOLLHUP, {c}};          \
+    struct epoll_event ev = {                                              \
+        EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLET, {c}};          \
     epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_ADD, (int) (size_t) c->fd, &ev); \
   } while (0)
-#define MG_EPOLL_MOD(c, wr)                                                \
-  do {                                                                     \
-    struct epoll_event ev = {EPOLLIN | EPOLLERR | EPOLLHUP, {c}};          \
-    if (wr) ev.events |= EPOLLOUT;                                         \
-    epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_MOD, (int) (size_t) c->fd, &ev); \
-  } while (0)
 #else
 #define MG_EPOLL_ADD(c)
-#define MG_EPOLL_MOD(c, wr)
 #endif
 
 #ifndef MG_ENABLE_PROFILE
@@ -973,13 +1013,43 @@ struct mg_timer {
   void (*fn)(void *);       // Function to call
   void *arg;                // Function argument
   struct mg_timer *next;    // Linkage
+  struct mg_timer **pprev;  // Link pointing at us, NULL if unlinked
+};
+
+// Hierarchical timing wheel, 1 ms ticks. Level N slots span 64^N ms, so
+// insert and cancel are O(1), and a timer is moved down at most once per
+// level before it fires
+#define MG_TIMER_WHEEL_BITS 6
+#define MG_TIMER_WHEEL_SLOTS (1 << MG_TIMER_WHEEL_BITS)
+#define MG_TIMER_WHEEL_LEVELS 6  // 2^36 ms, beyond that timers wrap around
+
+struct mg_timer_wheel {
+  uint64_t now;                  // Time the wheel has been advanced to
+  bool started;                  // Set by the first poll
+  uint64_t occupied[MG_TIMER_WHEEL_LEVELS];  // Bit per slot that may be used
+  struct mg_timer *slots[MG_TIMER_WHEEL_LEVELS][MG_TIMER_WHEEL_SLOTS];
+  struct mg_timer *added;        // New or still due, seen by the next poll
+  struct mg_timer *done;         // One-shot timers that have been called
 };
 
-void mg_timer_init(struct mg_timer **head, struct mg_timer *timer,
+void mg_timer_init(struct mg_timer_wheel *wheel, struct mg_timer *timer,
                    uint64_t milliseconds, unsigned flags, void (*fn)(void *),
                    void *arg);
-void mg_timer_free(struct mg_timer **head, struct mg_timer *);
-void mg_timer_poll(struct mg_timer **head, uint64_t new_ms);
+void mg_timer_free(struct mg_timer_wheel *wheel, struct mg_timer *);
+void mg_timer_poll(struct mg_timer_wheel *wheel, uint64_t new_ms);
+uint64_t mg_timer_next(struct mg_timer_wheel *wheel);
+void mg_timer_free_all(struct mg_timer_wheel *wheel);
+
+// Byte rate limit after the generic cell rate algorithm. The whole state is
+// one theoretical arrival time, so a limit may be shared by several managers
+struct mg_rate {
+  uint64_t rate;   // Bytes per second, 0 for no limit
+  uint64_t burst;  // Bytes that may pass back to back
+  uint64_t tat;    // Theoretical arrival time in microseconds
+};
+
+void mg_rate_init(struct mg_rate *, uint64_t rate, uint64_t burst);
+uint64_t mg_rate_reserve(struct mg_rate *, uint64_t now_ms, size_t n);
 bool mg_timer_expired(uint64_t *expiration, uint64_t period, uint64_t now);
 
 
@@ -1999,11 +2069,19 @@ struct mg_mgr {
   void *tls_ctx;                // TLS context shared by all TLS sessions
   uint16_t mqtt_id;             // MQTT IDs for pub/sub
   void *active_dns_requests;    // DNS requests in progress
-  struct mg_timer *timers;      // Active timers
+  struct mg_timer_wheel timers; // Active timers
   int epoll_fd;                 // Used when MG_EPOLL_ENABLE=1
   void *priv;                   // Used by the MIP stack
   size_t extraconnsize;         // Used by the MIP stack
   MG_SOCKET_TYPE pipe;          // Socketpair end for mg_wakeup()
+  bool reuseport;               // Listeners set SO_REUSEPORT, see workers
+  struct mg_rate *send_limit;   // Shared by accepted connections, or NULL
+  struct mg_rate *recv_limit;   // Shared by accepted connections, or NULL
+  struct mg_rate conn_send_limit;  // Copied to every accepted connection
+  struct mg_rate conn_recv_limit;  // Copied to every accepted connection
+  uint64_t resume_ms;           // Earliest time a throttled connection resumes
+  void *uring;                  // Batched socket IO, see mg_io_uring_init()
+  struct mg_connection *ready;  // Connections the next poll visits, epoll
 #if MG_ENABLE_FREERTOS_TCP
   SocketSet_t ss;  // NOTE(lsm): referenced from socket struct
 #endif
@@ -2011,6 +2089,8 @@ struct mg_mgr {
 
 struct mg_connection {
   struct mg_connection *next;  // Linkage in struct mg_mgr :: connections
+  struct mg_connection *ready_next;   // Linkage in struct mg_mgr :: ready
+  struct mg_connection **ready_prev;  // Link to us, NULL if not on the list
   struct mg_mgr *mgr;          // Our container
   struct mg_addr loc;          // Local address
   struct mg_addr rem;          // Remote address
@@ -2026,6 +2106,11 @@ struct mg_connection {
   void *pfn_data;              // Protocol-specific function parameter
   char data[MG_DATA_SIZE];     // Arbitrary connection data
   void *tls;                   // TLS specific data
+  struct mg_rate send_limit;   // Own send limit, see mg_mgr
+  struct mg_rate recv_limit;   // Own read limit, see mg_mgr
+  uint64_t resume_ms;          // Throttled connection moves data again then
+  size_t send_credit;          // Bytes booked with the send limits, unsent
+  size_t recv_credit;          // Bytes booked with the read limits, unread
   unsigned is_listening : 1;   // Listening connection
   unsigned is_client : 1;      // Outbound (client) connection
   unsigned is_accepted : 1;    // Accepted (server) connection
@@ -2044,11 +2129,21 @@ struct mg_connection {
   unsigned is_resp : 1;        // Response is still being generated
   unsigned is_readable : 1;    // Connection is ready to read
   unsigned is_writable : 1;    // Connection is ready to write
+  unsigned is_sendfile : 1;    // Body is written by sendfile(2), not c->send
+  unsigned is_send_throttled : 1;  // Sends wait for a rate limit
+  unsigned is_recv_throttled : 1;  // Reads wait for a rate limit, via is_full
+  unsigned is_ticking : 1;  // MG_EV_POLL on every poll even when idle, epoll
 };
 
+size_t mg_conn_quota(struct mg_connection *, bool is_send, size_t want);
+void mg_conn_charge(struct mg_connection *, bool is_send, size_t n);
+void mg_conn_ready(struct mg_connection *);
+
 void mg_mgr_poll(struct mg_mgr *, int ms);
 void mg_mgr_init(struct mg_mgr *);
 void mg_mgr_free(struct mg_mgr *);
+bool mg_io_uring_init(struct mg_mgr *);
+void mg_io_uring_free(struct mg_mgr *);
 
 struct mg_connection *mg_listen(struct mg_mgr *, const char *url,
                                 mg_event_handler_t fn, void *fn_data);
@@ -2123,6 +2218,8 @@ void mg_http_serve_dir(struct mg_connection *, struct mg_http_message *hm,
                        const struct mg_http_serve_opts *);
 void mg_http_serve_file(struct mg_connection *, struct mg_http_message *hm,
                         const char *path, const struct mg_http_serve_opts *);
+struct mg_str mg_http_guess_content_type(struct mg_str path, const char *extra);
+char *mg_http_etag(char *buf, size_t len, size_t size, time_t mtime);
 void mg_http_reply(struct mg_connection *, int status_code, const char *headers,
                    const char *body_fmt, ...);
 struct mg_str *mg_http_get_header(struct mg_http_message *, const char *name);
@@ -0,0 +1,89 @@
+#include <stdatomic.h>
+#include <stddef.h>
+
+typedef struct MpscNode
+{
+    _Atomic(struct MpscNode *) next;
+} MpscNode;
+
+/*
+ * general implement for multi-producer single-consumer queue
+ *
+ * intrusive, after Dmitry Vyukov's node based queue: embed an MpscNode in the
+ * element and get the element back with mpsc_entry. A push is one atomic
+ * exchange and never blocks, a pop is done by the single consumer without
+ * any atomic read-modify-write. A pop may return NULL while a producer is
+ * halfway through its push, the element shows up on a later pop.
+ */
+typedef struct
+{
+    _Atomic(MpscNode *) head; // producers swap themselves in here
+    MpscNode *tail;           // consumer side, oldest element
+    MpscNode stub;
+} MpscQueue;
+
+#define mpsc_entry(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+void mpsc_init(MpscQueue *queue);
+void mpsc_push(MpscQueue *queue, MpscNode *node);
+MpscNode *mpsc_pop(MpscQueue *queue);
+
+#ifdef MPSCQ_IMPLEMENTATION
+void mpsc_init(MpscQueue *queue)
+{
+    atomic_store_explicit(&queue->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&queue->head, &queue->stub, memory_order_relaxed);
+    queue->tail = &queue->stub;
+}
+
+// Append a node, safe to call from any thread.
+void mpsc_push(MpscQueue *queue, MpscNode *node)
+{
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+
+    MpscNode *prev = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+
+    // until this store the consumer sees the queue end at prev
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+// Remove the oldest node, return NULL if there is nothing to take yet. Consumer only.
+MpscNode *mpsc_pop(MpscQueue *queue)
+{
+    MpscNode *tail = queue->tail;
+    MpscNode *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    // step over the stub
+    if (tail == &queue->stub)
+    {
+        if (!next)
+            return NULL;
+
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+
+    if (next)
+    {
+        queue->tail = next;
+        return tail;
+    }
+
+    // a producer has swapped head but not linked its node yet
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire))
+        return NULL;
+
+    // tail is the last node, park the stub behind it so it can be handed out
+    mpsc_push(queue, &queue->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next)
+    {
+        queue->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+#endif
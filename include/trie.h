@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <string.h>
+
+#define TRIE_MIN_SIZE 16
+
+typedef struct
+{
+    unsigned char ch;   // byte on the edge into this node
+    int child, sibling; // first child and next sibling, -1 for none
+    int exact, prefix;  // values stored at this node, -1 for none
+} TrieNode;
+
+/*
+ * general implement for byte trie with exact and prefix keys
+ *
+ * keys go in while building, trie_compile then lays the children of every
+ * node out next to each other. A lookup reads the key once, and scans a
+ * short run of edge bytes per key byte, so its cost does not grow with the
+ * number of keys. It returns the value of the exact key, or else the value
+ * of the longest prefix key the key starts with.
+ */
+typedef struct
+{
+    TrieNode *nodes; // nodes[0] is the root, the empty key
+    int node_num, node_max;
+
+    // compiled form: the edges out of node i are [first[i], first[i + 1])
+    int *first;
+    unsigned char *label;
+    int *target;
+} Trie;
+
+Trie *createTrie();
+int trie_insert(Trie *trie, const char *key, size_t len, int is_prefix, int value);
+int trie_compile(Trie *trie);
+int trie_match(const Trie *trie, const char *key, size_t len);
+void freeTrie(Trie *trie);
+
+#ifdef TRIE_IMPLEMENTATION
+static int trie_new_node(Trie *trie, unsigned char ch)
+{
+    if (trie->node_num == trie->node_max)
+    {
+        TrieNode *temp = realloc(trie->nodes, sizeof(TrieNode) * trie->node_max * 2);
+        if (!temp)
+            return -1;
+        trie->nodes = temp;
+        trie->node_max *= 2;
+    }
+
+    TrieNode *node = trie->nodes + trie->node_num;
+    node->ch = ch;
+    node->child = node->sibling = -1;
+    node->exact = node->prefix = -1;
+    return trie->node_num++;
+}
+
+static void trie_drop_compiled(Trie *trie)
+{
+    free(trie->first);
+    free(trie->label);
+    free(trie->target);
+    trie->first = trie->target = NULL;
+    trie->label = NULL;
+}
+
+Trie *createTrie()
+{
+    Trie *trie = calloc(1, sizeof(Trie));
+    if (!trie)
+        return NULL;
+
+    trie->node_max = TRIE_MIN_SIZE;
+    trie->nodes = malloc(sizeof(TrieNode) * trie->node_max);
+    if (!trie->nodes || trie_new_node(trie, 0) != 0)
+    {
+        free(trie->nodes);
+        free(trie);
+        return NULL;
+    }
+
+    return trie;
+}
+
+// Add a key, it matches every longer key too if is_prefix is set. Return 1 if the key is taken, -1 if out of memory.
+int trie_insert(Trie *trie, const char *key, size_t len, int is_prefix, int value)
+{
+    int node = 0;
+
+    trie_drop_compiled(trie);
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        int child = trie->nodes[node].child;
+        while (child != -1 && trie->nodes[child].ch != (unsigned char)key[i])
+            child = trie->nodes[child].sibling;
+
+        if (child == -1)
+        {
+            if ((child = trie_new_node(trie, (unsigned char)key[i])) < 0)
+                return -1;
+            trie->nodes[child].sibling = trie->nodes[node].child;
+            trie->nodes[node].child = child;
+        }
+        node = child;
+    }
+
+    int *slot = is_prefix ? &trie->nodes[node].prefix : &trie->nodes[node].exact;
+    if (*slot != -1)
+        return 1;
+
+    *slot = value;
+    return 0;
+}
+
+// Lay the edges out for trie_match, return -1 if out of memory.
+int trie_compile(Trie *trie)
+{
+    int edge_num = trie->node_num - 1; // every node but the root hangs off one edge
+
+    trie_drop_compiled(trie);
+    trie->first = malloc(sizeof(int) * (trie->node_num + 1));
+    trie->label = malloc(edge_num > 0 ? edge_num : 1);
+    trie->target = malloc(sizeof(int) * (edge_num > 0 ? edge_num : 1));
+    if (!trie->first || !trie->label || !trie->target)
+    {
+        trie_drop_compiled(trie);
+        return -1;
+    }
+
+    int edge = 0;
+    for (int i = 0; i < trie->node_num; ++i)
+    {
+        trie->first[i] = edge;
+        for (int child = trie->nodes[i].child; child != -1; child = trie->nodes[child].sibling)
+        {
+            trie->label[edge] = trie->nodes[child].ch;
+            trie->target[edge++] = child;
+        }
+    }
+    trie->first[trie->node_num] = edge;
+    return 0;
+}
+
+// Look a key up in a compiled trie, return -1 if neither it nor a prefix of it is there.
+int trie_match(const Trie *trie, const char *key, size_t len)
+{
+    int node = 0, found = trie->nodes[0].prefix;
+
+    if (!trie->first)
+        return -1;
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        int edge = trie->first[node], end = trie->first[node + 1];
+        while (edge < end && trie->label[edge] != (unsigned char)key[i])
+            edge++;
+
+        if (edge == end)
+            return found;
+
+        node = trie->target[edge];
+        if (trie->nodes[node].prefix != -1)
+            found = trie->nodes[node].prefix;
+    }
+
+    return trie->nodes[node].exact != -1 ? trie->nodes[node].exact : found;
+}
+
+// Free the trie.
+void freeTrie(Trie *trie)
+{
+    if (!trie)
+        return;
+
+    trie_drop_compiled(trie);
+    free(trie->nodes);
+    free(trie);
+}
+#endif
@@ -1292,6 +1292,8 @@ static void mg_sendnsreq(struct mg_connection *c, struct mg_str *name, int ms,
     dnsc->c = mg_connect(c->mgr, dnsc->url, NULL, NULL);
     if (dnsc->c != NULL) {
       dnsc->c->pfn = dns_cb;
+      dnsc->c->is_ticking = 1;  // Times requests out on MG_EV_POLL
+      mg_conn_ready(dnsc->c);
       // dnsc->c->is_hexdumping = 1;
     }
   }
@@ -1362,6 +1364,7 @@ void mg_error(struct mg_connection *c, const char *fmt, ...) {
   va_end(ap);
   MG_ERROR(("%lu %ld %s", c->id, c->fd, buf));
   c->is_closing = 1;             // Set is_closing before sending MG_EV_CALL
+  mg_conn_ready(c);              // May be another connection, e.g. DNS
   mg_call(c, MG_EV_ERROR, buf);  // Let user handler override it
 }
 
@@ -2404,9 +2407,151 @@ static bool isok(uint8_t c) {
   return c == '\n' || c == '\r' || c >= ' ';
 }
 
+// HTTP head scanners. Each returns the first byte in [s, end) of its kind, or
+// end. mg_scan_ctl stops at a control byte, below ' '. mg_scan_text stops at a
+// byte clen() would not take as plain ascii, or at `stop`. mg_scan_eol stops
+// at \r or \n. The parser only looks at those bytes one at a time.
+static const char *mg_scan_ctl_c(const char *s, const char *end) {
+  while (s < end && (uint8_t) s[0] >= ' ') s++;
+  return s;
+}
+
+static const char *mg_scan_text_c(const char *s, const char *end, char stop) {
+  while (s < end && (uint8_t) s[0] > ' ' && (uint8_t) s[0] < '~' &&
+         s[0] != stop)
+    s++;
+  return s;
+}
+
+static const char *mg_scan_eol_c(const char *s, const char *end) {
+  while (s < end && s[0] != '\n' && s[0] != '\r') s++;
+  return s;
+}
+
+#if MG_ENABLE_SIMD
+#include <immintrin.h>
+
+// Highest path to use: 0 scalar, 1 SSE2, 2 AVX2. Tests lower it
+static int s_mg_scan_max = 2;
+
+static int mg_scan_level(void) {
+  if (s_mg_scan_max >= 2 && __builtin_cpu_supports("avx2")) return 2;
+  return s_mg_scan_max >= 1 ? 1 : 0;
+}
+
+// SSE2 is part of x86_64, these need no CPUID check
+static const char *mg_scan_ctl_sse2(const char *s, const char *end) {
+  const __m128i k = _mm_set1_epi8(0x1f);
+  for (; end - s >= 16; s += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) s);
+    int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(x, k), k));
+    if (m != 0) return s + __builtin_ctz((unsigned) m);
+  }
+  return mg_scan_ctl_c(s, end);
+}
+
+static const char *mg_scan_text_sse2(const char *s, const char *end,
+                                     char stop) {
+  const __m128i lo = _mm_set1_epi8('!'), span = _mm_set1_epi8('}' - '!');
+  const __m128i k = _mm_set1_epi8(stop);
+  for (; end - s >= 16; s += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) s);
+    __m128i d = _mm_sub_epi8(x, lo);  // Plain ascii is '!'..'}', d <= span
+    __m128i ok = _mm_cmpeq_epi8(_mm_min_epu8(d, span), d);
+    int m = (_mm_movemask_epi8(ok) ^ 0xffff) |
+            _mm_movemask_epi8(_mm_cmpeq_epi8(x, k));
+    if (m != 0) return s + __builtin_ctz((unsigned) m);
+  }
+  return mg_scan_text_c(s, end, stop);
+}
+
+static const char *mg_scan_eol_sse2(const char *s, const char *end) {
+  const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+  for (; end - s >= 16; s += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) s);
+    int m = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(x, cr), _mm_cmpeq_epi8(x, lf)));
+    if (m != 0) return s + __builtin_ctz((unsigned) m);
+  }
+  return mg_scan_eol_c(s, end);
+}
+
+// The same with 32 bytes a step, the tail goes through SSE2
+__attribute__((target("avx2"))) static const char *mg_scan_ctl_avx2(
+    const char *s, const char *end) {
+  const __m256i k = _mm256_set1_epi8(0x1f);
+  for (; end - s >= 32; s += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *) s);
+    unsigned m = (unsigned) _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_max_epu8(x, k), k));
+    if (m != 0) return s + __builtin_ctz(m);
+  }
+  return mg_scan_ctl_sse2(s, end);
+}
+
+__attribute__((target("avx2"))) static const char *mg_scan_text_avx2(
+    const char *s, const char *end, char stop) {
+  const __m256i lo = _mm256_set1_epi8('!'), span = _mm256_set1_epi8('}' - '!');
+  const __m256i k = _mm256_set1_epi8(stop);
+  for (; end - s >= 32; s += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *) s);
+    __m256i d = _mm256_sub_epi8(x, lo);
+    __m256i ok = _mm256_cmpeq_epi8(_mm256_min_epu8(d, span), d);
+    unsigned m = ~(unsigned) _mm256_movemask_epi8(ok) |
+                 (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, k));
+    if (m != 0) return s + __builtin_ctz(m);
+  }
+  return mg_scan_text_sse2(s, end, stop);
+}
+
+__attribute__((target("avx2"))) static const char *mg_scan_eol_avx2(
+    const char *s, const char *end) {
+  const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+  for (; end - s >= 32; s += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *) s);
+    unsigned m = (unsigned) _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(x, cr), _mm256_cmpeq_epi8(x, lf)));
+    if (m != 0) return s + __builtin_ctz(m);
+  }
+  return mg_scan_eol_sse2(s, end);
+}
+#endif
+
+static const char *mg_scan_ctl(const char *s, const char *end) {
+#if MG_ENABLE_SIMD
+  int level = mg_scan_level();
+  if (level == 2) return mg_scan_ctl_avx2(s, end);
+  if (level == 1) return mg_scan_ctl_sse2(s, end);
+#endif
+  return mg_scan_ctl_c(s, end);
+}
+
+static const char *mg_scan_text(const char *s, const char *end, char stop) {
+#if MG_ENABLE_SIMD
+  int level = mg_scan_level();
+  if (level == 2) return mg_scan_text_avx2(s, end, stop);
+  if (level == 1) return mg_scan_text_sse2(s, end, stop);
+#endif
+  return mg_scan_text_c(s, end, stop);
+}
+
+static const char *mg_scan_eol(const char *s, const char *end) {
+#if MG_ENABLE_SIMD
+  int level = mg_scan_level();
+  if (level == 2) return mg_scan_eol_avx2(s, end);
+  if (level == 1) return mg_scan_eol_sse2(s, end);
+#endif
+  return mg_scan_eol_c(s, end);
+}
+
 int mg_http_get_request_len(const unsigned char *buf, size_t buf_len) {
+  const char *s = (const char *) buf, *end, *p = s;
   size_t i;
-  for (i = 0; i < buf_len; i++) {
+  if (buf_len == 0) return 0;
+  end = s + buf_len;
+  // Every byte the scan skips is printable, neither bad nor a newline
+  while ((p = mg_scan_ctl(p, end)) < end) {
+    i = (size_t) (p++ - s);
     if (!isok(buf[i])) return -1;
     if ((i > 0 && buf[i] == '\n' && buf[i - 1] == '\n') ||
         (i > 3 && buf[i] == '\n' && buf[i - 1] == '\r' && buf[i - 2] == '\n'))
@@ -2443,7 +2588,7 @@ static size_t clen(const char *s, const char *end) {
 // Skip until the newline. Return advanced `s`, or NULL on error
 static const char *skiptorn(const char *s, const char *end, struct mg_str *v) {
   v->buf = (char *) s;
-  while (s < end && s[0] != '\n' && s[0] != '\r') s++, v->len++;  // To newline
+  s = mg_scan_eol(s, end), v->len += (size_t) (s - v->buf);       // To newline
   if (s >= end || (s[0] == '\r' && s[1] != '\n')) return NULL;    // Stray \r
   if (s < end && s[0] == '\r') s++;                               // Skip \r
   if (s >= end || *s++ != '\n') return NULL;                      // Skip \n
@@ -2458,6 +2603,7 @@ static bool mg_http_parse_headers(const char *s, const char *end,
     if (s >= end) return false;
     if (s[0] == '\n' || (s[0] == '\r' && s[1] == '\n')) break;
     k.buf = (char *) s;
+    s = mg_scan_text(s, end, ':'), k.len = (size_t) (s - k.buf);  // Plain ascii
     while (s < end && s[0] != ':' && (n = clen(s, end)) > 0) s += n, k.len += n;
     if (k.len == 0) return false;                     // Empty name
     if (s >= end || clen(s, end) == 0) return false;  // Invalid UTF-8
@@ -2488,9 +2634,11 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
 
   // Parse request line
   hm->method.buf = (char *) s;
+  s = mg_scan_text(s, end, ' '), hm->method.len = (size_t) (s - hm->method.buf);
   while (s < end && (n = clen(s, end)) > 0) s += n, hm->method.len += n;
   while (s < end && s[0] == ' ') s++;  // Skip spaces
   hm->uri.buf = (char *) s;
+  s = mg_scan_text(s, end, ' '), hm->uri.len = (size_t) (s - hm->uri.buf);
   while (s < end && (n = clen(s, end)) > 0) s += n, hm->uri.len += n;
   while (s < end && s[0] == ' ') s++;  // Skip spaces
   if ((s = skiptorn(s, end, &hm->proto)) == NULL) return false;
@@ -2695,8 +2843,78 @@ static void static_cb(struct mg_connection *c, int ev, void *ev_data) {
   (void) ev_data;
 }
 
-// Known mime types. Keep it outside guess_content_type() function, since
-// some environments don't like it defined there.
+#if MG_ENABLE_SENDFILE
+// Zero-copy transfer state: the body goes from our own descriptor straight
+// to the socket, bypassing stdio and c->send
+struct mg_sendfile {
+  int fd;            // File descriptor, owned by the transfer
+  int64_t offset;    // Next file offset to send
+  size_t remaining;  // Bytes left to send
+};
+
+static void restore_sendfile_cb(struct mg_connection *c) {
+  struct mg_sendfile *sf = (struct mg_sendfile *) c->pfn_data;
+  if (sf != NULL) close(sf->fd);
+  free(sf);
+  c->pfn_data = NULL;
+  c->pfn = http_cb;
+  c->is_resp = 0;
+  c->is_sendfile = 0;
+}
+
+static void sendfile_cb(struct mg_connection *c, int ev, void *ev_data) {
+  if (ev == MG_EV_WRITE && c->send.len == 0) {
+    // Headers are flushed, and the socket is writable
+    struct mg_sendfile *sf = (struct mg_sendfile *) c->pfn_data;
+    off_t off = (off_t) sf->offset;
+    size_t len = sf->remaining > 0x7ffff000 ? 0x7ffff000 : sf->remaining;
+    ssize_t n;
+    if ((len = mg_conn_quota(c, true, len)) == 0) return;  // Rate limited
+    n = sendfile((int) (size_t) c->fd, sf->fd, &off, len);
+    if (n > 0) {
+      if ((size_t) n < len) c->is_writable = 0;  // Socket is full
+      mg_conn_charge(c, true, (size_t) n);
+      *(long *) ev_data = (long) n;  // Let the user handler see the bytes
+      sf->offset = (int64_t) off;
+      sf->remaining -= (size_t) n;
+      if (sf->remaining == 0) restore_sendfile_cb(c);
+    } else if (n == 0) {
+      mg_error(c, "sendfile: file truncated, %lu left",
+               (unsigned long) sf->remaining);
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      c->is_writable = 0;  // Until the next EPOLLOUT
+    } else if (errno != EINTR) {
+      mg_error(c, "sendfile: %d", errno);
+    }
+  } else if (ev == MG_EV_CLOSE) {
+    restore_sendfile_cb(c);
+  }
+}
+
+// Switch connection to the sendfile path. Return false if the buffered
+// static_cb path must be used instead
+static bool mg_http_sendfile(struct mg_connection *c, struct mg_fs *fs,
+                             const char *path, size_t offset, size_t len) {
+  struct mg_sendfile *sf;
+  int fd;
+  if (c->is_tls || fs != &mg_fs_posix || len == 0) return false;
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return false;
+  if ((sf = (struct mg_sendfile *) calloc(1, sizeof(*sf))) == NULL) {
+    close(fd);
+    return false;
+  }
+  sf->fd = fd;
+  sf->offset = (int64_t) offset;
+  sf->remaining = len;
+  c->pfn = sendfile_cb;
+  c->pfn_data = sf;
+  c->is_sendfile = 1;
+  return true;
+}
+#endif
+
+// Known mime types. Keep it outside mg_http_guess_content_type() function,
+// since some environments don't like it defined there.
 // clang-format off
 #define MG_C_STR(a) { (char *) (a), sizeof(a) - 1 }
 static struct mg_str s_known_types[] = {
@@ -2734,7 +2952,8 @@ static struct mg_str s_known_types[] = {
 };
 // clang-format on
 
-static struct mg_str guess_content_type(struct mg_str path, const char *extra) {
+struct mg_str mg_http_guess_content_type(struct mg_str path,
+                                         const char *extra) {
   struct mg_str entry, k, v, s = mg_str(extra);
   size_t i = 0;
 
@@ -2781,7 +3000,8 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
   size_t size = 0;
   time_t mtime = 0;
   struct mg_str *inm = NULL;
-  struct mg_str mime = guess_content_type(mg_str(path), opts->mime_types);
+  struct mg_str mime =
+      mg_http_guess_content_type(mg_str(path), opts->mime_types);
   bool gzip = false;
 
   if (path != NULL) {
@@ -2804,7 +3024,7 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
   if (fd == NULL && opts->page404 != NULL) {
     fd = mg_fs_open(fs, opts->page404, MG_FS_READ);
     path = opts->page404;
-    mime = guess_content_type(mg_str(path), opts->mime_types);
+    mime = mg_http_guess_content_type(mg_str(path), opts->mime_types);
   }
 
   if (fd == NULL || fs->st(path, &size, &mtime) == 0) {
@@ -2854,6 +3074,10 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
       c->is_draining = 1;
       c->is_resp = 0;
       mg_fs_close(fd);
+#if MG_ENABLE_SENDFILE
+    } else if (mg_http_sendfile(c, fs, path, status == 206 ? r1 : 0, cl)) {
+      mg_fs_close(fd);
+#endif
     } else {
       // Track to-be-sent content length at the end of c->data, aligned
       size_t *clp = (size_t *) &c->data[(sizeof(c->data) - sizeof(size_t)) /
@@ -3233,6 +3457,7 @@ static void http_cb(struct mg_connection *c, int ev, void *ev_data) {
       }
       if (n == 0) break;                 // Request is not buffered yet
       mg_call(c, MG_EV_HTTP_HDRS, &hm);  // Got all HTTP headers
+      if (c->pfn != http_cb) return;     // Handler took over the body
       if (ev == MG_EV_CLOSE) {           // If client did not set Content-Length
         hm.message.len = c->recv.len - ofs;  // and closes now, deliver MSG
         hm.body.len = hm.message.len - (size_t) (hm.body.buf - hm.message.buf);
@@ -4630,6 +4855,7 @@ struct mg_connection *mg_mqtt_listen(struct mg_mgr *mgr, const char *url,
 size_t mg_vprintf(struct mg_connection *c, const char *fmt, va_list *ap) {
   size_t old = c->send.len;
   mg_vxprintf(mg_pfn_iobuf, &c->send, fmt, ap);
+  mg_conn_ready(c);
   return c->send.len - old;
 }
 
@@ -4756,6 +4982,29 @@ struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
   return c;
 }
 
+// Have the next mg_mgr_poll() visit c even if its socket reports nothing.
+// With epoll only connections on this list are polled, see mg_iotest().
+// Sends, printfs and errors call it, so must code that changes another
+// connection through its flags or buffers
+void mg_conn_ready(struct mg_connection *c) {
+#if MG_ENABLE_EPOLL
+  struct mg_connection **head = &c->mgr->ready;
+  if (c->ready_prev != NULL) return;
+  if ((c->ready_next = *head) != NULL)
+    c->ready_next->ready_prev = &c->ready_next;
+  *head = c, c->ready_prev = head;
+#else
+  (void) c;
+#endif
+}
+
+static void mg_conn_unready(struct mg_connection *c) {
+  if (c->ready_prev == NULL) return;
+  if ((*c->ready_prev = c->ready_next) != NULL)
+    c->ready_next->ready_prev = c->ready_prev;
+  c->ready_prev = NULL;
+}
+
 void mg_close_conn(struct mg_connection *c) {
   mg_resolve_cancel(c);  // Close any pending DNS query
   LIST_DELETE(struct mg_connection, &c->mgr->conns, c);
@@ -4764,6 +5013,7 @@ void mg_close_conn(struct mg_connection *c) {
   // Order of operations is important. `MG_EV_CLOSE` event must be fired
   // before we deallocate received data, see #1331
   mg_call(c, MG_EV_CLOSE, NULL);
+  mg_conn_unready(c);  // Last, the handler may have sent something
   MG_DEBUG(("%lu %ld closed", c->id, c->fd));
   MG_PROF_DUMP(c);
   MG_PROF_FREE(c);
@@ -4854,10 +5104,11 @@ long mg_io_recv(struct mg_connection *c, void *buf, size_t len) {
 
 void mg_mgr_free(struct mg_mgr *mgr) {
   struct mg_connection *c;
-  struct mg_timer *tmp, *t = mgr->timers;
-  while (t != NULL) tmp = t->next, free(t), t = tmp;
-  mgr->timers = NULL;  // Important. Next call to poll won't touch timers
-  for (c = mgr->conns; c != NULL; c = c->next) c->is_closing = 1;
+  mg_timer_free_all(&mgr->timers);  // Next call to poll won't touch timers
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    c->is_closing = 1;
+    mg_conn_ready(c);
+  }
   mg_mgr_poll(mgr, 0);
 #if MG_ENABLE_FREERTOS_TCP
   FreeRTOS_DeleteSocketSet(mgr->ss);
@@ -4866,6 +5117,7 @@ void mg_mgr_free(struct mg_mgr *mgr) {
 #if MG_ENABLE_EPOLL
   if (mgr->epoll_fd >= 0) close(mgr->epoll_fd), mgr->epoll_fd = -1;
 #endif
+  mg_io_uring_free(mgr);
   mg_tls_ctx_free(mgr);
 }
 
@@ -7310,9 +7562,6 @@ static void iolog(struct mg_connection *c, char *buf, long n, bool r) {
     } else {
       mg_iobuf_del(&c->send, 0, (size_t) n);
       // if (c->send.len == 0) mg_iobuf_resize(&c->send, 0);
-      if (c->send.len == 0) {
-        MG_EPOLL_MOD(c, 0);
-      }
       mg_call(c, MG_EV_WRITE, &n);
     }
   }
@@ -7327,9 +7576,13 @@ long mg_io_send(struct mg_connection *c, const void *buf, size_t len) {
     if (n > 0) setlocaddr(FD(c), &c->loc);
   } else {
     n = send(FD(c), (char *) buf, len, MSG_NONBLOCKING);
+    if (n > 0 && (size_t) n < len) c->is_writable = 0;  // Socket is full
   }
   MG_VERBOSE(("%lu %ld %d", c->id, n, MG_SOCK_ERR(n)));
-  if (MG_SOCK_PENDING(n)) return MG_IO_WAIT;
+  if (MG_SOCK_PENDING(n)) {
+    c->is_writable = 0;  // Until the next EPOLLOUT
+    return MG_IO_WAIT;
+  }
   if (MG_SOCK_RESET(n)) return MG_IO_RESET;
   if (n <= 0) return MG_IO_ERR;
   return n;
@@ -7343,6 +7596,7 @@ bool mg_send(struct mg_connection *c, const void *buf, size_t len) {
     iolog(c, (char *) buf, n, false);
     return n > 0;
   } else {
+    mg_conn_ready(c);
     return mg_iobuf_add(&c->send, c->send.len, buf, len);
   }
 }
@@ -7413,6 +7667,13 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
       // won't work! (setsockopt will return EINVAL)
       MG_ERROR(("setsockopt(SO_REUSEADDR): %d", MG_SOCK_ERR(rc)));
 #endif
+#if defined(SO_REUSEPORT) && !defined(LWIP_SOCKET)
+    } else if (c->mgr->reuseport &&
+               (rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &on,
+                                sizeof(on))) != 0) {
+      // Several managers bind the same port, the kernel spreads connections
+      MG_ERROR(("setsockopt(SO_REUSEPORT): %d", MG_SOCK_ERR(rc)));
+#endif
 #if MG_IPV6_V6ONLY
       // Bind only to the V6 address, not V4 address on this port
     } else if (c->loc.is_ip6 &&
@@ -7449,9 +7710,13 @@ static long recv_raw(struct mg_connection *c, void *buf, size_t len) {
     if (n > 0) tomgaddr(&usa, &c->rem, slen != sizeof(usa.sin));
   } else {
     n = recv(FD(c), (char *) buf, len, MSG_NONBLOCKING);
+    if (n > 0 && (size_t) n < len) c->is_readable = 0;  // Socket is empty
   }
   MG_VERBOSE(("%lu %ld %d", c->id, n, MG_SOCK_ERR(n)));
-  if (MG_SOCK_PENDING(n)) return MG_IO_WAIT;
+  if (MG_SOCK_PENDING(n)) {
+    c->is_readable = 0;  // Until the next EPOLLIN
+    return MG_IO_WAIT;
+  }
   if (MG_SOCK_RESET(n)) return MG_IO_RESET;
   if (n <= 0) return MG_IO_ERR;
   return n;
@@ -7470,17 +7735,31 @@ static bool ioalloc(struct mg_connection *c, struct mg_iobuf *io) {
   return res;
 }
 
+#if MG_ENABLE_IO_URING
+enum { MG_URING_RECV, MG_URING_SEND, MG_URING_ACCEPT };
+static bool mg_uring_want(struct mg_connection *c, int op);
+static void mg_uring_forget(struct mg_connection *c);
+#endif
+
 // NOTE(lsm): do only one iteration of reads, cause some systems
 // (e.g. FreeRTOS stack) return 0 instead of -1/EWOULDBLOCK when no data
 static void read_conn(struct mg_connection *c) {
+#if MG_ENABLE_IO_URING
+  if (c->mgr->uring != NULL && !c->is_tls && !c->is_udp &&
+      mg_uring_want(c, MG_URING_RECV))
+    return;  // Received with the others at the end of mg_mgr_poll()
+#endif
   if (ioalloc(c, &c->recv)) {
     char *buf = (char *) &c->recv.buf[c->recv.len];
     size_t len = c->recv.size - c->recv.len;
     long n = -1;
     if (c->is_tls) {
+      size_t room;
       if (!ioalloc(c, &c->rtls)) return;
-      n = recv_raw(c, (char *) &c->rtls.buf[c->rtls.len],
-                   c->rtls.size - c->rtls.len);
+      room = mg_conn_quota(c, false, c->rtls.size - c->rtls.len);
+      n = room == 0 ? MG_IO_WAIT
+                    : recv_raw(c, (char *) &c->rtls.buf[c->rtls.len], room);
+      if (n > 0) mg_conn_charge(c, false, (size_t) n);
       if (n == MG_IO_ERR && c->rtls.len == 0) {
         // Close only if we have fully drained both raw (rtls) and TLS buffers
         c->is_closing = 1;
@@ -7489,8 +7768,11 @@ static void read_conn(struct mg_connection *c) {
         if (c->is_tls_hs) mg_tls_handshake(c);
         n = c->is_tls_hs ? (long) MG_IO_WAIT : mg_tls_recv(c, buf, len);
       }
-    } else {
+    } else if ((len = mg_conn_quota(c, false, len)) > 0) {
       n = recv_raw(c, buf, len);
+      if (n > 0) mg_conn_charge(c, false, (size_t) n);
+    } else {
+      return;  // Rate limited
     }
     MG_DEBUG(("%lu %ld %lu:%lu:%lu %ld err %d", c->id, c->fd, c->send.len,
               c->recv.len, c->rtls.len, n, MG_SOCK_ERR(n)));
@@ -7501,7 +7783,19 @@ static void read_conn(struct mg_connection *c) {
 static void write_conn(struct mg_connection *c) {
   char *buf = (char *) c->send.buf;
   size_t len = c->send.len;
-  long n = c->is_tls ? mg_tls_send(c, buf, len) : mg_io_send(c, buf, len);
+  long n = 0;
+  if (len == 0 && c->is_sendfile) {
+    mg_call(c, MG_EV_WRITE, &n);  // Body is written by the protocol handler
+    return;
+  }
+#if MG_ENABLE_IO_URING
+  if (c->mgr->uring != NULL && !c->is_tls && !c->is_udp &&
+      mg_uring_want(c, MG_URING_SEND))
+    return;  // Sent with the others at the end of mg_mgr_poll()
+#endif
+  if (len > 0 && (len = mg_conn_quota(c, true, len)) == 0) return;  // Limited
+  n = c->is_tls ? mg_tls_send(c, buf, len) : mg_io_send(c, buf, len);
+  if (n > 0) mg_conn_charge(c, true, (size_t) n);
   MG_DEBUG(("%lu %ld snd %ld/%ld rcv %ld/%ld n=%ld err=%d", c->id, c->fd,
             (long) c->send.len, (long) c->send.size, (long) c->recv.len,
             (long) c->recv.size, n, MG_SOCK_ERR(n)));
@@ -7509,6 +7803,9 @@ static void write_conn(struct mg_connection *c) {
 }
 
 static void close_conn(struct mg_connection *c) {
+#if MG_ENABLE_IO_URING
+  if (c->mgr->uring != NULL) mg_uring_forget(c);
+#endif
   if (FD(c) != MG_INVALID_SOCKET) {
 #if MG_ENABLE_EPOLL
     epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_DEL, FD(c), NULL);
@@ -7529,7 +7826,6 @@ static void connect_conn(struct mg_connection *c) {
     c->is_connecting = 0;
     setlocaddr(FD(c), &c->loc);
     mg_call(c, MG_EV_CONNECT, NULL);
-    MG_EPOLL_MOD(c, 0);
     if (c->is_tls_hs) mg_tls_handshake(c);
   } else {
     mg_error(c, "socket error");
@@ -7601,11 +7897,11 @@ static MG_SOCKET_TYPE raccept(MG_SOCKET_TYPE sock, union usa *usa,
   return fd;
 }
 
-static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
+// Set up the connection for a socket accepted on lsn, fd is
+// MG_INVALID_SOCKET with errno set if accept failed
+static void accepted(struct mg_mgr *mgr, struct mg_connection *lsn,
+                     MG_SOCKET_TYPE fd, union usa *usa, socklen_t sa_len) {
   struct mg_connection *c = NULL;
-  union usa usa;
-  socklen_t sa_len = sizeof(usa);
-  MG_SOCKET_TYPE fd = raccept(FD(lsn), &usa, &sa_len);
   if (fd == MG_INVALID_SOCKET) {
 #if MG_ARCH == MG_ARCH_AZURERTOS || defined(__ECOS)
     // AzureRTOS, in non-block socket mode can mark listening socket readable
@@ -7624,7 +7920,7 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
     MG_ERROR(("%lu OOM", lsn->id));
     closesocket(fd);
   } else {
-    tomgaddr(&usa, &c->rem, sa_len != sizeof(usa.sin));
+    tomgaddr(usa, &c->rem, sa_len != sizeof(usa->sin));
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
     c->fd = S2PTR(fd);
     MG_EPOLL_ADD(c);
@@ -7637,6 +7933,8 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
     c->pfn_data = lsn->pfn_data;
     c->fn = lsn->fn;
     c->fn_data = lsn->fn_data;
+    c->send_limit = mgr->conn_send_limit;
+    c->recv_limit = mgr->conn_recv_limit;
     MG_DEBUG(("%lu %ld accepted %M -> %M", c->id, c->fd, mg_print_ip_port,
               &c->rem, mg_print_ip_port, &c->loc));
     mg_call(c, MG_EV_OPEN, NULL);
@@ -7644,14 +7942,380 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
   }
 }
 
+static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
+  union usa usa;
+  socklen_t sa_len = sizeof(usa);
+#if MG_ENABLE_IO_URING
+  if (mgr->uring != NULL && mg_uring_want(lsn, MG_URING_ACCEPT)) return;
+#endif
+  MG_SOCKET_TYPE fd = raccept(FD(lsn), &usa, &sa_len);
+  if (fd == MG_INVALID_SOCKET && MG_SOCK_PENDING(-1)) {
+    lsn->is_readable = 0;  // Backlog is empty
+  } else {
+    accepted(mgr, lsn, fd, &usa, sa_len);
+  }
+}
+
 static bool can_read(const struct mg_connection *c) {
   return c->is_full == false;
 }
 
 static bool can_write(const struct mg_connection *c) {
-  return c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0);
+  return (c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0) ||
+          c->is_sendfile) &&
+         !c->is_send_throttled;
+}
+
+// Return how many of want bytes may be moved now. Bytes are booked with the
+// connection's own and the shared limit a slice at a time, the connection
+// pauses until its slice is due, reads through is_full
+size_t mg_conn_quota(struct mg_connection *c, bool is_send, size_t want) {
+  struct mg_rate *own = is_send ? &c->send_limit : &c->recv_limit;
+  struct mg_rate *all = !c->is_accepted ? NULL
+                        : is_send       ? c->mgr->send_limit
+                                        : c->mgr->recv_limit;
+  size_t *credit = is_send ? &c->send_credit : &c->recv_credit;
+  uint64_t now, wait, w, slice;
+  if (own->rate == 0 && (all == NULL || all->rate == 0)) return want;
+  if (*credit == 0 && want > 0) {
+    // A quarter burst of the tighter limit, small enough to interleave
+    slice = own->rate ? own->burst : all->burst;
+    if (all != NULL && all->rate && all->burst < slice) slice = all->burst;
+    slice /= 4;
+    if (slice < MG_IO_SIZE) slice = MG_IO_SIZE;
+    if (slice > want) slice = want;
+    now = mg_millis();
+    wait = mg_rate_reserve(own, now, (size_t) slice);
+    if ((w = mg_rate_reserve(all, now, (size_t) slice)) > wait) wait = w;
+    *credit = (size_t) slice;
+    if (wait > 0) {
+      if ((!c->is_send_throttled && !c->is_recv_throttled) ||
+          now + wait < c->resume_ms)
+        c->resume_ms = now + wait;
+      if (c->mgr->resume_ms == 0 || c->resume_ms < c->mgr->resume_ms)
+        c->mgr->resume_ms = c->resume_ms;
+      if (is_send) {
+        c->is_send_throttled = 1;
+      } else {
+        c->is_recv_throttled = 1, c->is_full = 1;
+      }
+      return 0;
+    }
+  }
+  return *credit < want ? *credit : want;
+}
+
+// Account for n bytes moved out of what mg_conn_quota() allowed
+void mg_conn_charge(struct mg_connection *c, bool is_send, size_t n) {
+  size_t *credit = is_send ? &c->send_credit : &c->recv_credit;
+  *credit = n < *credit ? *credit - n : 0;
+}
+
+// Lift the pause set by mg_conn_quota(), the next call checks the limits again
+static void mg_conn_resume(struct mg_connection *c) {
+  if (c->is_recv_throttled) c->is_full = 0;
+  c->is_send_throttled = c->is_recv_throttled = 0;
+}
+
+#if MG_ENABLE_EPOLL
+// How soon must mg_mgr_poll() come back to c if no new event arrives for it:
+// 0 - not at all, 1 - on the next poll, 2 - at once. Sockets are edge
+// triggered, so is_readable and is_writable stay set until the socket runs
+// dry, see recv_raw() and mg_io_send()
+static int mg_conn_pending(struct mg_connection *c) {
+  if (c->is_closing || (c->is_draining && c->send.len == 0)) return 2;
+  if (c->is_resolving || FD(c) == MG_INVALID_SOCKET) return 0;
+  if (c->rtls.len > 0 || mg_tls_pending(c) > 0) c->is_readable = 1;
+  if (c->is_readable && can_read(c)) return 2;
+  if (c->is_writable && can_write(c)) return 2;
+  // Throttled ones wait for resume_ms, the rest for the handler to move on
+  if (c->is_send_throttled || c->is_recv_throttled) return 1;
+  return c->is_resp || c->is_readable || c->is_ticking ? 1 : 0;
+}
+#endif
+
+#if MG_ENABLE_IO_URING
+// Socket IO batched through io_uring. Readiness still comes from epoll, but
+// read_conn(), write_conn() and accept_conn() only note what a ready socket
+// needs, and mg_uring_flush() does it all in one io_uring_enter(2) at the end
+// of mg_mgr_poll(). Every request is non-blocking, MSG_DONTWAIT or
+// IORING_ACCEPT_DONTWAIT, so it completes inside that same call: buffers are
+// filled and drained before a handler can move them, and nothing is left in
+// flight when a connection closes. Responses written by the MG_EV_READ
+// handlers go out in a second round of the same flush
+#ifndef IORING_ACCEPT_DONTWAIT
+#define IORING_ACCEPT_DONTWAIT (1U << 1)
+#endif
+
+struct mg_uring_op {
+  struct mg_connection *c;  // NULL if the connection closed meanwhile
+  int op;                   // MG_URING_*
+  union usa usa;            // Accepted peer address
+  socklen_t usa_len;
+  size_t len;               // Bytes asked for, less means the socket ran dry
+};
+
+struct mg_uring {
+  int fd;
+  unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_len, cq_ring_len, sqes_len;
+  bool accept_nowait;  // Kernel takes IORING_ACCEPT_DONTWAIT, 6.10+
+  size_t n;            // Operations wanted by this poll
+  struct mg_uring_op ops[MG_IO_URING_ENTRIES];
+};
+
+static void mg_uring_free(struct mg_uring *u) {
+  if (u->sqes != NULL && u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_len);
+  if (u->cq_ring != NULL && u->cq_ring != MAP_FAILED &&
+      u->cq_ring != u->sq_ring)
+    munmap(u->cq_ring, u->cq_ring_len);
+  if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED)
+    munmap(u->sq_ring, u->sq_ring_len);
+  if (u->fd >= 0) close(u->fd);
+  free(u);
+}
+
+// Is every opcode we submit there? IORING_REGISTER_PROBE itself is 5.6+
+static bool mg_uring_probe(int fd) {
+  size_t len = sizeof(struct io_uring_probe) +
+               256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *p = (struct io_uring_probe *) calloc(1, len);
+  int ops[] = {IORING_OP_RECV, IORING_OP_SEND, IORING_OP_ACCEPT};
+  bool ok = p != NULL && syscall(__NR_io_uring_register, fd,
+                                 IORING_REGISTER_PROBE, p, 256) == 0;
+  for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++) {
+    ok = ops[i] <= p->last_op && (p->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(p);
+  return ok;
+}
+
+// Move the socket IO of mgr to io_uring. Return false, and stay on plain
+// epoll, if the kernel has no usable io_uring
+bool mg_io_uring_init(struct mg_mgr *mgr) {
+  struct io_uring_params p;
+  struct mg_uring *u;
+  char *sq, *cq;
+  if (mgr->uring != NULL) return true;
+  if ((u = (struct mg_uring *) calloc(1, sizeof(*u))) == NULL) return false;
+  memset(&p, 0, sizeof(p));
+  u->fd = (int) syscall(__NR_io_uring_setup, MG_IO_URING_ENTRIES, &p);
+  if (u->fd < 0) {
+    MG_ERROR(("io_uring_setup errno %d", errno));
+    free(u);
+    return false;
+  }
+  u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && u->cq_ring_len > u->sq_ring_len)
+    u->sq_ring_len = u->cq_ring_len;
+  u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  u->cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP)
+                   ? u->sq_ring
+                   : mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+  u->sqes = (struct io_uring_sqe *) mmap(NULL, u->sqes_len,
+                                         PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, u->fd,
+                                         IORING_OFF_SQES);
+  if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED ||
+      u->sqes == MAP_FAILED || !mg_uring_probe(u->fd)) {
+    MG_ERROR(("io_uring unusable, errno %d", errno));
+    mg_uring_free(u);
+    return false;
+  }
+  sq = (char *) u->sq_ring, cq = (char *) u->cq_ring;
+  u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *) (sq + p.sq_off.array);
+  u->cq_head = (unsigned *) (cq + p.cq_off.head);
+  u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  u->accept_nowait = true;  // Until the kernel says EINVAL
+  mgr->uring = u;
+  MG_DEBUG(("io_uring fd %d, %u entries", u->fd, p.sq_entries));
+  return true;
+}
+
+// Put mgr back on plain epoll. Only between polls, nothing is in flight then
+void mg_io_uring_free(struct mg_mgr *mgr) {
+  if (mgr->uring != NULL) mg_uring_free((struct mg_uring *) mgr->uring);
+  mgr->uring = NULL;
 }
 
+// Note an operation for the next flush. Return false if it has to be done
+// inline instead: the batch is full, or accepts would not complete at once
+static bool mg_uring_want(struct mg_connection *c, int op) {
+  struct mg_uring *u = (struct mg_uring *) c->mgr->uring;
+  if (u->n >= MG_IO_URING_ENTRIES) return false;
+  if (op == MG_URING_ACCEPT && !u->accept_nowait) return false;
+  u->ops[u->n].c = c, u->ops[u->n].op = op, u->n++;
+  return true;
+}
+
+static void mg_uring_forget(struct mg_connection *c) {
+  struct mg_uring *u = (struct mg_uring *) c->mgr->uring;
+  for (size_t i = 0; i < u->n; i++) {
+    if (u->ops[i].c == c) u->ops[i].c = NULL;
+  }
+}
+
+// Fill the SQE for ops[i] from the connection as it is now. Return false if
+// there is nothing to do after all
+static bool mg_uring_prep(struct mg_uring *u, size_t i,
+                          struct io_uring_sqe *sqe) {
+  struct mg_uring_op *o = &u->ops[i];
+  struct mg_connection *c = o->c;
+  size_t len;
+  if (c == NULL || c->is_closing) return false;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = FD(c);
+  sqe->user_data = i;
+  if (o->op == MG_URING_ACCEPT) {
+    memset(&o->usa, 0, sizeof(o->usa));
+    o->usa_len = sizeof(o->usa);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->addr = (uint64_t) (size_t) &o->usa;
+    sqe->addr2 = (uint64_t) (size_t) &o->usa_len;
+    sqe->ioprio = IORING_ACCEPT_DONTWAIT;
+    return true;
+  }
+  if (o->op == MG_URING_RECV) {
+    if (!ioalloc(c, &c->recv)) return false;
+    len = mg_conn_quota(c, false, c->recv.size - c->recv.len);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->addr = (uint64_t) (size_t) &c->recv.buf[c->recv.len];
+  } else {
+    len = c->send.len == 0 ? 0 : mg_conn_quota(c, true, c->send.len);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr = (uint64_t) (size_t) c->send.buf;
+  }
+  if (len == 0) return false;  // Rate limited, or nothing left to send
+  o->len = len > INT32_MAX ? INT32_MAX : len;
+  sqe->len = (uint32_t) o->len;
+  sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+  return true;
+}
+
+static void mg_uring_done(struct mg_uring *u, struct mg_uring_op *o, int res) {
+  struct mg_connection *c = o->c;
+  long n = res > 0                             ? (long) res
+           : res == -EAGAIN || res == -EINTR   ? (long) MG_IO_WAIT
+           : res == -ECONNRESET || res == -EPIPE ? (long) MG_IO_RESET
+                                                : (long) MG_IO_ERR;
+  if (o->op == MG_URING_ACCEPT) {
+    if (n == MG_IO_WAIT) c->is_readable = 0;  // Backlog is empty
+    if (res == -EINVAL) {
+      u->accept_nowait = false;  // Older kernel, accept inline from now on
+    } else if (res >= 0) {
+      accepted(c->mgr, c, (MG_SOCKET_TYPE) res, &o->usa, o->usa_len);
+    } else if (n != MG_IO_WAIT) {
+      errno = -res;
+      accepted(c->mgr, c, MG_INVALID_SOCKET, &o->usa, o->usa_len);
+    }
+    return;
+  }
+  if (n > 0) mg_conn_charge(c, o->op == MG_URING_SEND, (size_t) n);
+  if (n == MG_IO_WAIT || (n > 0 && (size_t) n < o->len)) {
+    if (o->op == MG_URING_RECV) c->is_readable = 0;  // Same as recv_raw()
+    if (o->op == MG_URING_SEND) c->is_writable = 0;
+  }
+  MG_DEBUG(("%lu %ld %s %lu:%lu n=%ld", c->id, c->fd,
+            o->op == MG_URING_RECV ? "rcv" : "snd", c->recv.len, c->send.len,
+            n));
+  if (o->op == MG_URING_RECV) {
+    iolog(c, (char *) &c->recv.buf[c->recv.len], n, true);
+    // Send what the handler answered in the next round of this flush
+    if (n > 0 && !c->is_closing && c->send.len > 0 && c->is_writable &&
+        can_write(c))
+      mg_uring_want(c, MG_URING_SEND);
+  } else {
+    iolog(c, (char *) c->send.buf, n, false);
+  }
+}
+
+static unsigned mg_uring_reap(struct mg_uring *u) {
+  unsigned head = *u->cq_head, n = 0;
+  while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+    size_t i = (size_t) cqe->user_data;
+    int res = cqe->res;
+    __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+    mg_uring_done(u, &u->ops[i], res);
+    n++;
+  }
+  return n;
+}
+
+// Submit everything wanted by this poll, and handle the results
+static void mg_uring_flush(struct mg_mgr *mgr) {
+  struct mg_uring *u = (struct mg_uring *) mgr->uring;
+  size_t i = 0, end;
+  while (i < u->n) {
+    unsigned tail = *u->sq_tail, queued = 0, submit;
+    for (end = u->n; i < end; i++) {
+      unsigned slot = tail & *u->sq_mask;
+      if (!mg_uring_prep(u, i, &u->sqes[slot])) continue;
+      u->sq_array[slot] = slot;
+      tail++, queued++;
+    }
+    __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+    // No handler runs before the whole round is submitted and complete, one
+    // may grow or free c->send while a SEND still points into it. The kernel
+    // waits for completions only once it has submitted all it was asked to,
+    // non-blocking requests complete while being submitted
+    for (submit = queued; submit > 0;) {
+      int rc = (int) syscall(__NR_io_uring_enter, u->fd, submit, queued,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+      if (rc > 0) {
+        submit -= (unsigned) rc;
+      } else if (rc < 0 && errno == EINTR) {
+        continue;
+      } else {
+        // Take back what the kernel did not get, those connections stay
+        // ready and try again on the next poll
+        if (rc < 0 && errno != EAGAIN && errno != EBUSY)
+          MG_ERROR(("io_uring_enter errno %d", errno));
+        __atomic_store_n(u->sq_tail, tail - submit, __ATOMIC_RELEASE);
+        queued -= submit;
+        submit = 0;
+      }
+    }
+    while (__atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) - *u->cq_head <
+           queued) {
+      if (syscall(__NR_io_uring_enter, u->fd, 0, queued,
+                  IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+          errno != EINTR) {
+        MG_ERROR(("io_uring_enter errno %d", errno));
+        break;
+      }
+    }
+    mg_uring_reap(u);
+  }
+  // The connections were polled before their IO ran, see what is left
+  for (i = 0; i < u->n; i++) {
+    if (u->ops[i].c != NULL && mg_conn_pending(u->ops[i].c))
+      mg_conn_ready(u->ops[i].c);
+  }
+  u->n = 0;
+}
+#else
+bool mg_io_uring_init(struct mg_mgr *mgr) {
+  (void) mgr;
+  return false;
+}
+
+void mg_io_uring_free(struct mg_mgr *mgr) {
+  (void) mgr;
+}
+#endif
+
 static bool skip_iotest(const struct mg_connection *c) {
   return (c->is_closing || c->is_resolving || FD(c) == MG_INVALID_SOCKET) ||
          (can_read(c) == false && can_write(c) == false);
@@ -7678,26 +8342,24 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
                       eSELECT_READ | eSELECT_EXCEPT | eSELECT_WRITE);
   }
 #elif MG_ENABLE_EPOLL
-  size_t max = 1;
-  for (struct mg_connection *c = mgr->conns; c != NULL; c = c->next) {
-    c->is_readable = c->is_writable = 0;
-    if (c->rtls.len > 0 || mg_tls_pending(c) > 0) ms = 1, c->is_readable = 1;
-    if (can_write(c)) MG_EPOLL_MOD(c, 1);
-    if (c->is_closing) ms = 1;
-    max++;
+  // Idle connections cost nothing here: only those on the ready list can
+  // have work without a new event, and events only add to that list
+  struct epoll_event evs[MG_EPOLL_EVENTS];
+  for (struct mg_connection *c = mgr->ready; c != NULL; c = c->ready_next) {
+    if (mg_conn_pending(c) == 2) {
+      ms = 0;
+      break;
+    }
   }
-  struct epoll_event *evs = (struct epoll_event *) alloca(max * sizeof(evs[0]));
-  int n = epoll_wait(mgr->epoll_fd, evs, (int) max, ms);
+  int n = epoll_wait(mgr->epoll_fd, evs, MG_EPOLL_EVENTS, ms);
   for (int i = 0; i < n; i++) {
     struct mg_connection *c = (struct mg_connection *) evs[i].data.ptr;
     if (evs[i].events & EPOLLERR) {
       mg_error(c, "socket error");
-    } else if (c->is_readable == 0) {
-      bool rd = evs[i].events & (EPOLLIN | EPOLLHUP);
-      bool wr = evs[i].events & EPOLLOUT;
-      c->is_readable = can_read(c) && rd ? 1U : 0;
-      c->is_writable = can_write(c) && wr ? 1U : 0;
-      if (c->rtls.len > 0 || mg_tls_pending(c) > 0) c->is_readable = 1;
+    } else {
+      if (evs[i].events & (EPOLLIN | EPOLLHUP)) c->is_readable = 1;
+      if (evs[i].events & EPOLLOUT) c->is_writable = 1;
+      mg_conn_ready(c);
     }
   }
   (void) skip_iotest;
@@ -7878,43 +8540,94 @@ bool mg_wakeup(struct mg_mgr *mgr, unsigned long conn_id, const void *buf,
   return false;
 }
 
-void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
-  struct mg_connection *c, *tmp;
-  uint64_t now;
+// Deliver MG_EV_POLL to c and do its IO. Return false if c got closed
+static bool poll_conn(struct mg_connection *c, uint64_t now) {
+  struct mg_mgr *mgr = c->mgr;
+  bool is_resp = c->is_resp;
+  if (c->is_send_throttled || c->is_recv_throttled) {
+    if (c->resume_ms <= now) {
+      mg_conn_resume(c);
+    } else if (mgr->resume_ms == 0 || c->resume_ms < mgr->resume_ms) {
+      mgr->resume_ms = c->resume_ms;
+    }
+  }
+  mg_call(c, MG_EV_POLL, &now);
+  if (is_resp && !c->is_resp) {
+    long n = 0;
+    mg_call(c, MG_EV_READ, &n);
+  }
+  MG_VERBOSE(("%lu %c%c %c%c%c%c%c %lu %lu", c->id,
+              c->is_readable ? 'r' : '-', c->is_writable ? 'w' : '-',
+              c->is_tls ? 'T' : 't', c->is_connecting ? 'C' : 'c',
+              c->is_tls_hs ? 'H' : 'h', c->is_resolving ? 'R' : 'r',
+              c->is_closing ? 'C' : 'c', mg_tls_pending(c), c->rtls.len));
+  if (c->is_resolving || c->is_closing) {
+    // Do nothing
+  } else if (c->is_listening && c->is_udp == 0) {
+    if (c->is_readable) accept_conn(mgr, c);
+  } else if (c->is_connecting) {
+    if (c->is_readable || c->is_writable) connect_conn(c);
+    //} else if (c->is_tls_hs) {
+    //  if ((c->is_readable || c->is_writable)) mg_tls_handshake(c);
+  } else {
+    if (c->is_readable && can_read(c)) read_conn(c);
+    if (c->is_writable && can_write(c)) write_conn(c);
+  }
+
+  if (c->is_draining && c->send.len == 0) c->is_closing = 1;
+  if (c->is_closing) {
+    close_conn(c);
+    return false;
+  }
+  return true;
+}
 
+void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
+  struct mg_connection *c;
+  uint64_t now, next;
+
+  // Wake up in time for the next timer and for throttled connections
+  next = mg_timer_next(&mgr->timers);
+  if (mgr->resume_ms != 0 && mgr->resume_ms < next) next = mgr->resume_ms;
+  if (next != UINT64_MAX) {
+    now = mg_millis();
+    if (next <= now) {
+      ms = 0;
+    } else if (next - now < (uint64_t) ms) {
+      ms = (int) (next - now);
+    }
+  }
   mg_iotest(mgr, ms);
   now = mg_millis();
   mg_timer_poll(&mgr->timers, now);
+  if (mgr->resume_ms != 0 && mgr->resume_ms <= now) mgr->resume_ms = 0;
 
-  for (c = mgr->conns; c != NULL; c = tmp) {
-    bool is_resp = c->is_resp;
-    tmp = c->next;
-    mg_call(c, MG_EV_POLL, &now);
-    if (is_resp && !c->is_resp) {
-      long n = 0;
-      mg_call(c, MG_EV_READ, &n);
+#if MG_ENABLE_EPOLL
+  // Visit the ready list only, idle connections get no MG_EV_POLL unless
+  // they set is_ticking, e.g. to time out. A connection stays on the list
+  // while it is visited, so sends to it do not queue it again
+  {
+    struct mg_connection *list;
+    if ((list = mgr->ready) != NULL) list->ready_prev = &list;
+    mgr->ready = NULL;
+    while ((c = list) != NULL) {
+      if (!poll_conn(c, now)) continue;  // Closed, and off the list
+      mg_conn_unready(c);
+      if (mg_conn_pending(c)) mg_conn_ready(c);
     }
-    MG_VERBOSE(("%lu %c%c %c%c%c%c%c %lu %lu", c->id,
-                c->is_readable ? 'r' : '-', c->is_writable ? 'w' : '-',
-                c->is_tls ? 'T' : 't', c->is_connecting ? 'C' : 'c',
-                c->is_tls_hs ? 'H' : 'h', c->is_resolving ? 'R' : 'r',
-                c->is_closing ? 'C' : 'c', mg_tls_pending(c), c->rtls.len));
-    if (c->is_resolving || c->is_closing) {
-      // Do nothing
-    } else if (c->is_listening && c->is_udp == 0) {
-      if (c->is_readable) accept_conn(mgr, c);
-    } else if (c->is_connecting) {
-      if (c->is_readable || c->is_writable) connect_conn(c);
-      //} else if (c->is_tls_hs) {
-      //  if ((c->is_readable || c->is_writable)) mg_tls_handshake(c);
-    } else {
-      if (c->is_readable) read_conn(c);
-      if (c->is_writable) write_conn(c);
+  }
+#else
+  {
+    struct mg_connection *tmp;
+    for (c = mgr->conns; c != NULL; c = tmp) {
+      tmp = c->next;
+      poll_conn(c, now);
     }
-
-    if (c->is_draining && c->send.len == 0) c->is_closing = 1;
-    if (c->is_closing) close_conn(c);
   }
+#endif
+#if MG_ENABLE_IO_URING
+  if (mgr->uring != NULL) mg_uring_flush(mgr);
+#endif
 }
 #endif
 
@@ -8198,17 +8911,46 @@ bool mg_str_to_num(struct mg_str str, int base, void *val, size_t val_len) {
 
 
 #define MG_TIMER_CALLED 4
+#define MG_TIMER_WHEEL_MASK (MG_TIMER_WHEEL_SLOTS - 1)
+
+static void mg_timer_link(struct mg_timer **head, struct mg_timer *t) {
+  t->next = *head;
+  if (*head) (*head)->pprev = &t->next;
+  *head = t;
+  t->pprev = head;
+}
+
+static void mg_timer_unlink(struct mg_timer *t) {
+  if (t->pprev == NULL) return;
+  *t->pprev = t->next;
+  if (t->next) t->next->pprev = t->pprev;
+  t->next = NULL, t->pprev = NULL;
+}
+
+// Put a timer that expires after wheel->now on the level where its
+// expiration first differs from the wheel time
+static void mg_timer_place(struct mg_timer_wheel *w, struct mg_timer *t) {
+  uint64_t diff = t->expire ^ w->now;
+  unsigned level = 0, slot;
+  while (level + 1 < MG_TIMER_WHEEL_LEVELS &&
+         (diff >> (MG_TIMER_WHEEL_BITS * (level + 1))) != 0)
+    level++;
+  slot = (unsigned) (t->expire >> (MG_TIMER_WHEEL_BITS * level)) &
+         MG_TIMER_WHEEL_MASK;
+  mg_timer_link(&w->slots[level][slot], t);
+  w->occupied[level] |= (uint64_t) 1 << slot;
+}
 
-void mg_timer_init(struct mg_timer **head, struct mg_timer *t, uint64_t ms,
+void mg_timer_init(struct mg_timer_wheel *w, struct mg_timer *t, uint64_t ms,
                    unsigned flags, void (*fn)(void *), void *arg) {
   t->id = 0, t->period_ms = ms, t->expire = 0;
-  t->flags = flags, t->fn = fn, t->arg = arg, t->next = *head;
-  *head = t;
+  t->flags = flags, t->fn = fn, t->arg = arg, t->pprev = NULL;
+  mg_timer_link(&w->added, t);
 }
 
-void mg_timer_free(struct mg_timer **head, struct mg_timer *t) {
-  while (*head && *head != t) head = &(*head)->next;
-  if (*head) *head = t->next;
+void mg_timer_free(struct mg_timer_wheel *w, struct mg_timer *t) {
+  mg_timer_unlink(t);
+  (void) w;
 }
 
 // t: expiration time, prd: period, now: current time. Return true if expired
@@ -8220,21 +8962,153 @@ bool mg_timer_expired(uint64_t *t, uint64_t prd, uint64_t now) {
   return true;                                   // Expired, return true
 }
 
-void mg_timer_poll(struct mg_timer **head, uint64_t now_ms) {
-  struct mg_timer *t, *tmp;
-  for (t = *head; t != NULL; t = tmp) {
-    bool once = t->expire == 0 && (t->flags & MG_TIMER_RUN_NOW) &&
-                !(t->flags & MG_TIMER_CALLED);  // Handle MG_TIMER_NOW only once
-    bool expired = mg_timer_expired(&t->expire, t->period_ms, now_ms);
-    tmp = t->next;
-    if (!once && !expired) continue;
+// Move the slots the wheel time passes over on its way to now to todo
+static void mg_timer_collect(struct mg_timer_wheel *w, uint64_t now,
+                             struct mg_timer **todo) {
+  unsigned level, slot;
+  for (level = 0; level < MG_TIMER_WHEEL_LEVELS; level++) {
+    uint64_t from = w->now >> (MG_TIMER_WHEEL_BITS * level);
+    uint64_t to = now >> (MG_TIMER_WHEEL_BITS * level), mask, bits;
+    unsigned first = (unsigned) (from + 1) & MG_TIMER_WHEEL_MASK;
+    if (to == from) break;  // Coarser levels did not move either
+    if (to - from >= MG_TIMER_WHEEL_SLOTS) {
+      mask = ~(uint64_t) 0;
+    } else {
+      mask = ((uint64_t) 1 << (to - from)) - 1;
+      if (first) mask = (mask << first) | (mask >> (64 - first));
+    }
+    bits = w->occupied[level] & mask;
+    w->occupied[level] &= ~mask;
+    for (slot = 0; bits != 0; slot++, bits >>= 1) {
+      struct mg_timer *t;
+      if (!(bits & 1)) continue;
+      while ((t = w->slots[level][slot]) != NULL) {
+        mg_timer_unlink(t);
+        mg_timer_link(todo, t);
+      }
+    }
+  }
+}
+
+void mg_timer_poll(struct mg_timer_wheel *w, uint64_t now_ms) {
+  struct mg_timer *t, *todo = NULL;
+  if (!w->started) w->now = now_ms, w->started = true;
+  if (now_ms < w->now) now_ms = w->now;  // Never step the wheel back
+  while ((t = w->added) != NULL) mg_timer_unlink(t), mg_timer_link(&todo, t);
+  mg_timer_collect(w, now_ms, &todo);
+  w->now = now_ms;
+
+  // Reschedule before calling, so that fn may free its own timer
+  while ((t = todo) != NULL) {
+    bool due;
+    mg_timer_unlink(t);
+    if (t->expire == 0) {  // First poll? Set expiration
+      t->expire = now_ms + t->period_ms;
+      due = (t->flags & MG_TIMER_RUN_NOW) || t->expire <= now_ms;
+    } else {
+      due = t->expire <= now_ms;
+    }
+    if (!due) {
+      mg_timer_place(w, t);
+      continue;
+    }
+    if (t->flags & MG_TIMER_REPEAT) {
+      if (t->expire <= now_ms)
+        t->expire = (now_ms - t->expire) > t->period_ms
+                        ? now_ms + t->period_ms
+                        : t->expire + t->period_ms;
+      if (t->expire <= now_ms) {
+        mg_timer_link(&w->added, t);  // Still due, the next poll calls it
+      } else {
+        mg_timer_place(w, t);
+      }
+    } else {
+      mg_timer_link(&w->done, t);
+    }
     if ((t->flags & MG_TIMER_REPEAT) || !(t->flags & MG_TIMER_CALLED)) {
+      t->flags |= MG_TIMER_CALLED;
       t->fn(t->arg);
     }
-    t->flags |= MG_TIMER_CALLED;
   }
 }
 
+// Earliest time a timer on the wheel may be due, UINT64_MAX if there is none.
+// A slot above level 0 only tells when its timers move down, which is early
+// but never late
+uint64_t mg_timer_next(struct mg_timer_wheel *w) {
+  uint64_t next = UINT64_MAX;
+  unsigned level;
+  if (w->added != NULL) return 0;
+  for (level = 0; level < MG_TIMER_WHEEL_LEVELS; level++) {
+    unsigned shift = MG_TIMER_WHEEL_BITS * level, cur, slot;
+    uint64_t bits = w->occupied[level], at;
+    if (bits == 0) continue;
+    cur = (unsigned) (w->now >> shift) & MG_TIMER_WHEEL_MASK;
+    for (slot = 1; slot <= MG_TIMER_WHEEL_SLOTS; slot++) {
+      if (bits & ((uint64_t) 1 << ((cur + slot) & MG_TIMER_WHEEL_MASK))) break;
+    }
+    at = ((w->now >> shift) + slot) << shift;
+    if (at < next) next = at;
+  }
+  return next;
+}
+
+// Free every timer on the wheel, for timers allocated by mg_timer_add()
+void mg_timer_free_all(struct mg_timer_wheel *w) {
+  struct mg_timer *t;
+  unsigned level, slot;
+  for (level = 0; level < MG_TIMER_WHEEL_LEVELS; level++) {
+    for (slot = 0; slot < MG_TIMER_WHEEL_SLOTS; slot++) {
+      while ((t = w->slots[level][slot]) != NULL) mg_timer_unlink(t), free(t);
+    }
+    w->occupied[level] = 0;
+  }
+  while ((t = w->added) != NULL) mg_timer_unlink(t), free(t);
+  while ((t = w->done) != NULL) mg_timer_unlink(t), free(t);
+}
+
+#ifdef MG_ENABLE_LINES
+#line 1 "src/rate.c"
+#endif
+
+
+
+// A shared limit is charged by several threads, the single word state
+// makes that one compare-and-swap
+#if defined(__GNUC__) || defined(__clang__)
+#define MG_RATE_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define MG_RATE_CAS(p, old, val)                                   \
+  __atomic_compare_exchange_n((p), &(old), (val), false, __ATOMIC_RELAXED, \
+                              __ATOMIC_RELAXED)
+#else
+#define MG_RATE_LOAD(p) (*(p))
+#define MG_RATE_CAS(p, old, val) (*(p) = (val), true)
+#endif
+
+void mg_rate_init(struct mg_rate *r, uint64_t rate, uint64_t burst) {
+  r->rate = rate;
+  r->burst = burst < MG_IO_SIZE ? MG_IO_SIZE : burst;
+  r->tat = 0;
+}
+
+// Microseconds n bytes take at the limit, rounded up
+static uint64_t mg_rate_cost(const struct mg_rate *r, uint64_t n) {
+  return (n * 1000000 + r->rate - 1) / r->rate;
+}
+
+// Book n bytes, return milliseconds until they may pass. Bookings are
+// served in the order they are made, which keeps sharing a limit fair
+uint64_t mg_rate_reserve(struct mg_rate *r, uint64_t now_ms, size_t n) {
+  uint64_t now = now_ms * 1000, tat, next, at;
+  if (r == NULL || r->rate == 0) return 0;
+  tat = MG_RATE_LOAD(&r->tat);
+  do {
+    next = (tat > now ? tat : now) + mg_rate_cost(r, n);
+  } while (!MG_RATE_CAS(&r->tat, tat, next));
+  at = next - mg_rate_cost(r, r->burst);
+  return at > now ? (at - now + 999) / 1000 : 0;
+}
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/tls_aes128.c"
 #endif
@@ -15343,6 +16217,7 @@ size_t mg_ws_wrap(struct mg_connection *c, size_t len, int op) {
   memmove(p, p - header_len, len);             // Shift data
   memcpy(p - header_len, header, header_len);  // Prepend header
   mg_ws_mask(c, len);                          // Mask data
+  mg_conn_ready(c);
 
   return c->send.len;
 }
@@ -0,0 +1,237 @@
+/*
+ * upload path checks: chunks that overlap bytes already received, sent with
+ * other bytes, must not reach the file, so the finalized file matches the
+ * digest dedup indexes it under
+ *
+ * FileBay.c is compiled in and serves one worker on a loopback port, a client
+ * thread talks plain HTTP to it. Exits non-zero on the first failed check.
+ *
+ * gcc test/upload_test.c mongoose.c -Iinclude -O2 -pthread -o upload_test
+ */
+#define FILEBAY_NO_MAIN
+
+#include "../FileBay.c"
+
+#define CHUNK (256 * 1024) // over what one read brings in, so the streaming path is taken
+
+static char scratch_dir[32];
+static int port;
+static int failed;
+static volatile int client_done;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failed = 1;                                                     \
+            return -1;                                                      \
+        }                                                                   \
+    } while (0)
+
+/*
+ * one request on a connection of its own, the reply body is copied to out
+ * Returns: the HTTP status, -1 on a transport error
+ *
+ */
+static int request(const char *uri, const char *body, size_t len, char *out, size_t out_len)
+{
+    struct sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    char head[256], reply[512];
+    size_t got = 0;
+    int fd = socket(AF_INET, SOCK_STREAM, 0), status = -1;
+
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0)
+        goto done;
+
+    int n = snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\nHost: x\r\nConnection: close\r\nContent-Length: %lu\r\n\r\n",
+                     body ? "POST" : "GET", uri, (unsigned long)len);
+    if (send(fd, head, n, MSG_NOSIGNAL) != n || (len && send(fd, body, len, MSG_NOSIGNAL) != (ssize_t)len))
+        goto done;
+
+    // the server keeps the connection open, read up to the end of the body
+    char *sep = NULL, *cl;
+    size_t want = sizeof(reply) - 1;
+    for (ssize_t r; got < want && (r = recv(fd, reply + got, sizeof(reply) - 1 - got, 0)) > 0;)
+    {
+        got += r;
+        reply[got] = '\0';
+        if (!sep && (sep = strstr(reply, "\r\n\r\n")) && (cl = strstr(reply, "Content-Length: ")) && cl < sep)
+            want = (size_t)(sep + 4 - reply) + strtoul(cl + 16, NULL, 10);
+    }
+    reply[got] = '\0';
+
+    if (sscanf(reply, "HTTP/1.1 %d", &status) != 1 || !sep)
+        status = -1;
+    else if (out)
+        snprintf(out, out_len, "%s", sep + 4);
+
+done:
+    if (fd >= 0)
+        close(fd);
+    return status;
+}
+
+static int apply()
+{
+    char body[128];
+
+    if (request("/api/apply", NULL, 0, body, sizeof(body)) != 200)
+        return -1;
+    return (int)mg_json_get_long(mg_str(body), "$.code", -1);
+}
+
+// send len bytes of ch at offset
+static int upload(int sid, size_t offset, size_t len, char ch)
+{
+    char uri[96], *body = malloc(len);
+    int status;
+
+    memset(body, ch, len);
+    snprintf(uri, sizeof(uri), "/api/upload?sid=%d&offset=%lu", sid, (unsigned long)offset);
+    status = request(uri, body, len, NULL, 0);
+    free(body);
+    return status;
+}
+
+/*
+ * finalize, then compare the stored file and the node's digest with what was expected
+ * Returns: 0 if both match
+ *
+ */
+static int finalize_and_check(int sid, const char *expected, size_t len)
+{
+    char uri[96], body[128];
+    unsigned char digest[32];
+    mg_sha256_ctx sha;
+
+    snprintf(uri, sizeof(uri), "/api/finalizer?sid=%d&size=%lu&file=overlap.bin", sid, (unsigned long)len);
+    CHECK(request(uri, NULL, 0, body, sizeof(body)) == 200);
+    int code = (int)mg_json_get_long(mg_str(body), "$.code", -1);
+
+    mg_sha256_init(&sha);
+    mg_sha256_update(&sha, (const unsigned char *)expected, len);
+    mg_sha256_final(digest, &sha);
+
+    FileNode_read_lock();
+    FileNode *node = get_FileNode(code);
+    int id = node ? node->id : -1;
+    int same_digest = node && memcmp(node->digest, digest, sizeof(digest)) == 0;
+    FileNode_read_unlock();
+
+    CHECK(node != NULL);
+    CHECK(same_digest);
+
+    char path[96], *stored = malloc(len + 1);
+    snprintf(path, sizeof(path), "%s/%d", storage_dir, id);
+    FILE *file = fopen(path, "rb");
+    size_t n = file ? fread(stored, 1, len + 1, file) : 0;
+    if (file)
+        fclose(file);
+    int same_file = n == len && memcmp(stored, expected, len) == 0;
+    free(stored);
+
+    CHECK(same_file);
+    return 0;
+}
+
+// a chunk sent again over the hashed prefix, and one that runs past its end
+static int check_hashed_overlap()
+{
+    char *expected = malloc(3 * CHUNK);
+    int sid = apply();
+
+    CHECK(sid >= 0);
+    CHECK(upload(sid, 0, 2 * CHUNK, 'a') == 200);
+    CHECK(upload(sid, 0, CHUNK, 'b') == 200);
+    CHECK(upload(sid, CHUNK, 2 * CHUNK, 'c') == 200);
+
+    memset(expected, 'a', 2 * CHUNK);
+    memset(expected + 2 * CHUNK, 'c', CHUNK);
+    int ret = finalize_and_check(sid, expected, 3 * CHUNK);
+    free(expected);
+    return ret;
+}
+
+// chunks received ahead of the prefix keep their bytes too
+static int check_pending_overlap()
+{
+    char *expected = malloc(3 * CHUNK);
+    int sid = apply();
+
+    CHECK(sid >= 0);
+    CHECK(upload(sid, 2 * CHUNK, CHUNK, 'x') == 200);
+    CHECK(upload(sid, CHUNK, 2 * CHUNK, 'y') == 200);
+    CHECK(upload(sid, 0, CHUNK, 'z') == 200);
+
+    memset(expected, 'z', CHUNK);
+    memset(expected + CHUNK, 'y', CHUNK);
+    memset(expected + 2 * CHUNK, 'x', CHUNK);
+    int ret = finalize_and_check(sid, expected, 3 * CHUNK);
+    free(expected);
+    return ret;
+}
+
+static void *client(void *data)
+{
+    if (check_hashed_overlap() == 0 && check_pending_overlap() == 0)
+        fprintf(stderr, "upload_test: ok\n");
+
+    client_done = 1;
+    (void)data;
+    return NULL;
+}
+
+int main()
+{
+    pthread_t client_tid;
+
+    strcpy(scratch_dir, "/tmp/fbut.XXXXXX");
+    if (!mkdtemp(scratch_dir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(storage_dir, sizeof(storage_dir), "%s/files", scratch_dir);
+    snprintf(dump_dist, sizeof(dump_dist), "%s/dump.bin", scratch_dir);
+    snprintf(journal_dist, sizeof(journal_dist), "%s/journal.bin", scratch_dir);
+    mkdir(storage_dir, 0700);
+
+    file_max_byte = 16 * CHUNK;
+    file_max_count = 16;
+    file_expire = 10;
+    session_max_count = 4;
+    session_expire = 10;
+    worker_count = 1;
+    mg_log_set(MG_LL_ERROR);
+
+    FileNode_hashmap = createHashmap(HASHMAP_SIZE);
+    Blob_hashmap = createHashmap(HASHMAP_SIZE);
+    expiry_heap = createMinHeap(HASHMAP_SIZE);
+    mpsc_init(&schedule_queue);
+    mpsc_init(&expired_queue);
+    mpsc_init(&unlink_queue);
+    sem_init(&cleaner_sem, 0, 0);
+
+    WorkerList = calloc(1, sizeof(Worker));
+    if (!WorkerList || init_SessionList() || init_routes())
+        return 1;
+
+    mg_mgr_init(&WorkerList->mgr);
+    WorkerList->mgr.userdata = WorkerList;
+    WorkerList->subscribers = createHashmap(HASHMAP_SIZE);
+
+    struct mg_connection *listener = mg_http_listen(&WorkerList->mgr, "http://127.0.0.1:0", server_fn, NULL);
+    if (!listener)
+        return 1;
+    port = mg_ntohs(listener->loc.port);
+
+    pthread_create(&client_tid, NULL, client, NULL);
+    while (!client_done)
+        mg_mgr_poll(&WorkerList->mgr, 50);
+    pthread_join(client_tid, NULL);
+
+    mg_mgr_free(&WorkerList->mgr);
+    return failed;
+}